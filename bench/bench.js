@@ -0,0 +1,213 @@
+// Offline benchmark for the demux/decode/convert/deliver path.
+//
+//   node bench/bench.js [--codec h264|hevc] [--size 1920x1080] [--fps 25]
+//                       [--seconds 10] [--streams 1,8,32] [--format rgb32]
+//                       [--rtsp] [--duration 10] [--out results.json]
+//
+// Test clips are generated once with the ffmpeg CLI from lavfi's testsrc2
+// and cached in bench/clips. By default every stream decodes the clip
+// from disk as fast as it can; with --rtsp, ffmpeg pushes the clip at real
+// time into a loopback relay (bench/relay.js), one path per stream, and
+// each stream is read back over RTSP for --duration seconds instead.
+//
+// Results are printed as one JSON object per run. `poolFallbacks` counts
+// frames that found their stream's buffer pool empty and had to allocate
+// (getPoolStats().exhausted); it is not a count of all allocations.
+
+const { spawn, spawnSync } = require('child_process');
+const fs = require('fs');
+const path = require('path');
+const { Rtsp } = require('../index');
+
+function parseArgs(argv) {
+   const args = {
+      codec: 'h264',
+      size: '1920x1080',
+      fps: 25,
+      seconds: 10,
+      streams: '1,8,32',
+      format: 'rgb32',
+      rtsp: false,
+      duration: 10,
+      out: null
+   };
+   for (let i = 0; i < argv.length; i++) {
+      const key = argv[i].replace(/^--/, '');
+      if (!(key in args)) {
+         throw new Error(`unknown option ${argv[i]}`);
+      }
+      args[key] = typeof args[key] === 'boolean' ? true : argv[++i];
+   }
+   args.streams = String(args.streams).split(',').map(Number);
+   return args;
+}
+
+function clipPath(args) {
+   const dir = path.join(__dirname, 'clips');
+   const file = path.join(dir, `${args.codec}-${args.size}-${args.fps}-${args.seconds}s.mkv`);
+   if (fs.existsSync(file)) {
+      return file;
+   }
+
+   fs.mkdirSync(dir, { recursive: true });
+   const encoder = args.codec === 'hevc' ? 'libx265' : 'libx264';
+   const result = spawnSync('ffmpeg', [
+      '-hide_banner', '-loglevel', 'error', '-y',
+      '-f', 'lavfi', '-i', `testsrc2=size=${args.size}:rate=${args.fps}:duration=${args.seconds}`,
+      '-c:v', encoder, '-preset', 'veryfast', '-g', String(args.fps * 2), '-bf', '2',
+      '-pix_fmt', 'yuv420p', file
+   ], { stdio: 'inherit' });
+   if (result.status !== 0) {
+      throw new Error('ffmpeg failed to generate the test clip; is it on PATH?');
+   }
+   return file;
+}
+
+// Starts the relay in its own process, so that its CPU time is not
+// counted against the streams, and resolves once it accepts connections.
+function startRelay(port) {
+   return new Promise((resolve, reject) => {
+      const relay = spawn(process.execPath, [path.join(__dirname, 'relay.js'), String(port)], {
+         stdio: ['ignore', 'pipe', 'inherit']
+      });
+      relay.once('error', reject);
+      relay.once('exit', (code) => reject(new Error(`relay exited with ${code}`)));
+      relay.stdout.once('data', () => resolve(relay));
+   });
+}
+
+// One ffmpeg publisher per stream, looping the clip at real time.
+function publish(file, port, index) {
+   const url = `rtsp://127.0.0.1:${port}/bench${index}`;
+   const publisher = spawn('ffmpeg', [
+      '-hide_banner', '-loglevel', 'error',
+      '-re', '-stream_loop', '-1', '-i', file,
+      '-c', 'copy', '-f', 'rtsp', '-rtsp_transport', 'tcp', url
+   ], { stdio: 'ignore' });
+   return { url, publisher };
+}
+
+async function openWithRetry(rtsp, url, options) {
+   for (let attempt = 0; ; attempt++) {
+      try {
+         return await rtsp.open(url, options);
+      } catch (err) {
+         if (attempt >= 20) {
+            throw err;
+         }
+         await new Promise((resolve) => setTimeout(resolve, 250));
+      }
+   }
+}
+
+async function consume(rtsp, deadline) {
+   let frames = 0;
+   for (;;) {
+      if (deadline && Date.now() >= deadline) {
+         return frames;
+      }
+      const frame = await rtsp.read();
+      if (!frame) {
+         return frames;
+      }
+      frames++;
+      // Only pool Buffers go back; native planes are freed by the GC.
+      if (Buffer.isBuffer(frame)) {
+         rtsp.release(frame);
+      }
+   }
+}
+
+function merge(stats) {
+   const stages = ['demux', 'decode', 'convert', 'deliver'];
+   const result = { bytesOut: 0, bytesCopied: 0 };
+   for (const stage of stages) {
+      // Percentiles of the slowest stream; counts and means over all.
+      const all = stats.map((s) => s[stage]);
+      const count = all.reduce((n, h) => n + h.count, 0);
+      result[stage] = {
+         count,
+         mean: count ? all.reduce((n, h) => n + h.mean * h.count, 0) / count : 0,
+         p50: Math.max(...all.map((h) => h.p50)),
+         p90: Math.max(...all.map((h) => h.p90)),
+         p99: Math.max(...all.map((h) => h.p99)),
+         max: Math.max(...all.map((h) => h.max))
+      };
+   }
+   for (const s of stats) {
+      result.bytesOut += s.bytesOut;
+      result.bytesCopied += s.bytesCopied;
+   }
+   return result;
+}
+
+async function run(args, file, count) {
+   const streams = [];
+   const servers = [];
+   const port = 18554;
+   if (args.rtsp) {
+      servers.push(await startRelay(port));
+   }
+   for (let i = 0; i < count; i++) {
+      let url = file;
+      if (args.rtsp) {
+         const served = publish(file, port, i);
+         servers.push(served.publisher);
+         url = served.url;
+      }
+      streams.push({ rtsp: new Rtsp(), url });
+   }
+
+   const options = { format: args.format };
+   try {
+      await Promise.all(streams.map((s) => openWithRetry(s.rtsp, s.url, options)));
+
+      const cpu = process.cpuUsage();
+      const start = process.hrtime.bigint();
+      const deadline = args.rtsp ? Date.now() + args.duration * 1000 : 0;
+      const frames = await Promise.all(streams.map((s) => consume(s.rtsp, deadline)));
+      const elapsed = Number(process.hrtime.bigint() - start) / 1e9;
+      const used = process.cpuUsage(cpu);
+
+      const total = frames.reduce((a, b) => a + b, 0);
+      const pool = streams.map((s) => s.rtsp.getPoolStats());
+      return {
+         codec: args.codec,
+         size: args.size,
+         format: args.format,
+         source: args.rtsp ? 'rtsp' : 'file',
+         streams: count,
+         frames: total,
+         seconds: elapsed,
+         fps: total / elapsed,
+         fpsPerStream: total / elapsed / count,
+         cpuPerStream: (used.user + used.system) / 1e6 / elapsed / count,
+         poolFallbacks: pool.reduce((n, p) => n + p.exhausted, 0),
+         rss: process.memoryUsage().rss,
+         ...merge(streams.map((s) => s.rtsp.getStats()))
+      };
+   } finally {
+      streams.forEach((s) => s.rtsp.close());
+      servers.forEach((server) => {
+         server.removeAllListeners('exit');
+         server.kill();
+      });
+   }
+}
+
+(async () => {
+   const args = parseArgs(process.argv.slice(2));
+   const file = clipPath(args);
+   const results = [];
+   for (const count of args.streams) {
+      const result = await run(args, file, count);
+      console.log(JSON.stringify(result));
+      results.push(result);
+   }
+   if (args.out) {
+      fs.writeFileSync(args.out, JSON.stringify(results, null, 2));
+   }
+})().catch((err) => {
+   console.error(err);
+   process.exit(1);
+});
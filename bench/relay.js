@@ -0,0 +1,204 @@
+// Minimal loopback RTSP relay for bench.js --rtsp.
+//
+//   node bench/relay.js <port>
+//
+// ffmpeg's RTSP muxer can only push (ANNOUNCE/RECORD) to a server, so
+// publishers push each path here and readers pull it back with
+// DESCRIBE/SETUP/PLAY. Only RTP interleaved over TCP is supported, which
+// is what both sides use. Prints "listening" once it accepts connections.
+
+const net = require('net');
+
+const paths = new Map();
+let sessions = 0;
+
+function pathOf(url) {
+   return new URL(url).pathname.replace(/\/(streamid|trackID)=\d+$/, '');
+}
+
+function controlOf(url) {
+   const match = /\/((streamid|trackID)=\d+)$/.exec(new URL(url).pathname);
+   return match ? match[1] : '';
+}
+
+function reply(socket, cseq, status, headers = {}, body = '') {
+   let text = `RTSP/1.0 ${status}\r\nCSeq: ${cseq}\r\n`;
+   for (const [name, value] of Object.entries(headers)) {
+      text += `${name}: ${value}\r\n`;
+   }
+   if (body) {
+      text += `Content-Length: ${Buffer.byteLength(body)}\r\n`;
+   }
+   socket.write(`${text}\r\n${body}`);
+}
+
+// Forwards one interleaved packet from a publisher to every reader of the
+// same track, on the channels that reader asked for.
+function relay(conn, channel, packet) {
+   const stream = paths.get(conn.path);
+   const track = conn.channels.get(channel & ~1);
+   if (!stream || stream.publisher !== conn || track === undefined) {
+      return;
+   }
+   for (const reader of stream.readers) {
+      const base = reader.tracks.get(track);
+      if (base === undefined || !reader.playing || reader.socket.writableLength > 8 << 20) {
+         continue;
+      }
+      const header = Buffer.from([0x24, base + (channel & 1), packet.length >> 8, packet.length & 0xff]);
+      reader.socket.write(Buffer.concat([header, packet]));
+   }
+}
+
+function request(conn, method, url, headers, body) {
+   const socket = conn.socket;
+   const cseq = headers.cseq;
+   switch (method) {
+      case 'OPTIONS':
+         return reply(socket, cseq, '200 OK', {
+            Public: 'OPTIONS, DESCRIBE, ANNOUNCE, SETUP, PLAY, RECORD, TEARDOWN, GET_PARAMETER'
+         });
+
+      case 'ANNOUNCE': {
+         conn.path = pathOf(url);
+         const stream = paths.get(conn.path) || { readers: new Set() };
+         stream.publisher = conn;
+         stream.sdp = body;
+         paths.set(conn.path, stream);
+         return reply(socket, cseq, '200 OK');
+      }
+
+      case 'DESCRIBE': {
+         const stream = paths.get(pathOf(url));
+         if (!stream || !stream.recording) {
+            return reply(socket, cseq, '404 Not Found');
+         }
+         return reply(socket, cseq, '200 OK', {
+            'Content-Base': `${url.replace(/\/$/, '')}/`,
+            'Content-Type': 'application/sdp'
+         }, stream.sdp);
+      }
+
+      case 'SETUP': {
+         const transport = headers.transport || '';
+         const match = /interleaved=(\d+)/.exec(transport);
+         if (!/TCP/.test(transport) || !match) {
+            return reply(socket, cseq, '461 Unsupported Transport');
+         }
+         const channel = Number(match[1]);
+         if (conn.path === undefined) {
+            conn.path = pathOf(url);
+         }
+         if (paths.get(conn.path) && paths.get(conn.path).publisher === conn) {
+            conn.channels.set(channel, controlOf(url));
+         } else {
+            conn.tracks.set(controlOf(url), channel);
+         }
+         conn.session = conn.session || String(++sessions);
+         return reply(socket, cseq, '200 OK', { Transport: transport, Session: conn.session });
+      }
+
+      case 'RECORD': {
+         const stream = paths.get(conn.path);
+         if (stream && stream.publisher === conn) {
+            stream.recording = true;
+         }
+         return reply(socket, cseq, '200 OK', { Session: conn.session });
+      }
+
+      case 'PLAY': {
+         const stream = paths.get(conn.path);
+         if (!stream || !stream.recording) {
+            return reply(socket, cseq, '404 Not Found');
+         }
+         reply(socket, cseq, '200 OK', { Session: conn.session, Range: 'npt=0.000-' });
+         conn.playing = true;
+         stream.readers.add(conn);
+         return;
+      }
+
+      case 'TEARDOWN':
+         reply(socket, cseq, '200 OK', { Session: conn.session });
+         return socket.end();
+
+      case 'GET_PARAMETER':
+         return reply(socket, cseq, '200 OK', { Session: conn.session });
+
+      default:
+         return reply(socket, cseq, '501 Not Implemented');
+   }
+}
+
+// Splits the byte stream into RTSP messages and interleaved packets.
+function parse(conn) {
+   for (;;) {
+      const data = conn.buffer;
+      if (data.length === 0) {
+         return;
+      }
+
+      if (data[0] === 0x24) {
+         if (data.length < 4) {
+            return;
+         }
+         const length = data.readUInt16BE(2);
+         if (data.length < 4 + length) {
+            return;
+         }
+         relay(conn, data[1], data.subarray(4, 4 + length));
+         conn.buffer = data.subarray(4 + length);
+         continue;
+      }
+
+      const end = data.indexOf('\r\n\r\n');
+      if (end < 0) {
+         return;
+      }
+      const lines = data.subarray(0, end).toString().split('\r\n');
+      const headers = {};
+      for (const line of lines.slice(1)) {
+         const colon = line.indexOf(':');
+         if (colon > 0) {
+            headers[line.slice(0, colon).trim().toLowerCase()] = line.slice(colon + 1).trim();
+         }
+      }
+      const length = Number(headers['content-length'] || 0);
+      if (data.length < end + 4 + length) {
+         return;
+      }
+      const body = data.subarray(end + 4, end + 4 + length).toString();
+      conn.buffer = data.subarray(end + 4 + length);
+
+      const [method, url] = lines[0].split(' ');
+      request(conn, method, url, headers, body);
+   }
+}
+
+function close(conn) {
+   const stream = paths.get(conn.path);
+   if (!stream) {
+      return;
+   }
+   stream.readers.delete(conn);
+   if (stream.publisher === conn) {
+      paths.delete(conn.path);
+      for (const reader of stream.readers) {
+         reader.socket.destroy();
+      }
+   }
+}
+
+const server = net.createServer((socket) => {
+   const conn = { socket, buffer: Buffer.alloc(0), channels: new Map(), tracks: new Map(), playing: false };
+   socket.setNoDelay(true);
+   socket.on('data', (chunk) => {
+      conn.buffer = conn.buffer.length ? Buffer.concat([conn.buffer, chunk]) : chunk;
+      parse(conn);
+   });
+   socket.on('error', () => {});
+   socket.on('close', () => close(conn));
+});
+
+server.listen(Number(process.argv[2] || 8554), '127.0.0.1', () => {
+   console.log('listening');
+});
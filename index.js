@@ -0,0 +1,90 @@
+const { Readable } = require('stream');
+const { Rtsp, StreamManager } = require('./build/Release/rtsp.node');
+
+// Yields decoded frames until the stream ends; each step waits for the
+// previous read() to settle, so the native worker never runs ahead of JS.
+Rtsp.prototype[Symbol.asyncIterator] = async function* () {
+   for (;;) {
+      const frame = await this.read();
+      if (!frame) {
+         return;
+      }
+      yield frame;
+   }
+};
+
+// Object-mode Readable over the frames; a frame is only read when the
+// consumer asks for more, which gives backpressure down to the socket.
+Rtsp.prototype.stream = function (options) {
+   return Readable.from(this, Object.assign({ highWaterMark: 1 }, options));
+};
+
+// Frames published by Rtsp#setRing() into a SharedArrayBuffer, readable in
+// place from any worker_thread; the layout is described with FrameRing in
+// src/rtsp.cpp. Post `ring.buffer` to a worker and wrap it there again.
+const RING_HEADER = 64;
+const SLOT_HEADER = 64;
+
+class FrameRing {
+   // Room for `slots` images of up to `frameSize` bytes each.
+   static create(slots, frameSize) {
+      const slotSize = SLOT_HEADER + Math.ceil(frameSize / 64) * 64;
+      const ring = new FrameRing(new SharedArrayBuffer(RING_HEADER + slots * slotSize));
+      ring.count = slots;
+      return ring;
+   }
+
+   constructor(buffer) {
+      this.buffer = buffer;
+      this.words = new Int32Array(buffer);
+      this.count = this.words[0];
+   }
+
+   // Sequence number of the newest frame, 0 before the first.
+   get published() {
+      return Atomics.load(this.words, 3);
+   }
+
+   // Blocks until a frame newer than `seq` is out or `timeout` ms pass,
+   // then returns the newest sequence number.
+   wait(seq, timeout) {
+      Atomics.wait(this.words, 3, seq, timeout);
+      return this.published;
+   }
+
+   // Frame `seq`, viewed in place, or null once it has been overwritten.
+   // Check valid() again after using the data.
+   frame(seq) {
+      const slots = this.words[0];
+      const offset = RING_HEADER + ((seq - 1) % slots) * this.words[1];
+      const header = offset / 4;
+      if (seq < 1 || Atomics.load(this.words, header) !== seq) {
+         return null;
+      }
+
+      const name = new Uint8Array(this.buffer, offset + 40, 16);
+      const end = name.indexOf(0);
+      const frame = {
+         seq,
+         width: this.words[header + 1],
+         height: this.words[header + 2],
+         stride: Array.from(this.words.subarray(header + 4, header + 8)),
+         pts: new Float64Array(this.buffer, offset + 32, 1)[0],
+         format: String.fromCharCode(...name.subarray(0, end < 0 ? 16 : end)),
+         data: new Uint8Array(this.buffer, offset + SLOT_HEADER, this.words[header + 3])
+      };
+      return this.valid(frame) ? frame : null;
+   }
+
+   // False once the writer has lapped the frame's slot.
+   valid(frame) {
+      return Atomics.load(this.words, (frame.data.byteOffset - SLOT_HEADER) / 4) === frame.seq;
+   }
+}
+
+// Publishes frames into `ring` instead of returning Buffers; null stops.
+Rtsp.prototype.useRing = function (ring) {
+   this.setRing(ring ? ring.words : null, ring ? ring.count : 0);
+};
+
+module.exports = { Rtsp, StreamManager, FrameRing };
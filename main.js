@@ -1,12 +1,13 @@
-const { Rtsp } = require('./build/Release/rtsp.node');
+const { Rtsp } = require('./index');
 
-const rtsp = new Rtsp();
+(async () => {
+   const rtsp = new Rtsp();
 
-rtsp.open("rtsp://192.168.3.239/ch0/main");
+   await rtsp.open("rtsp://192.168.3.239/ch0/main");
 
-for (;;) {
-   const buff = rtsp.read();
-   console.log(buff && buff.length);
-}
+   for await (const buff of rtsp) {
+      console.log(buff && buff.length);
+   }
 
-rtsp.close(); 
\ No newline at end of file
+   rtsp.close();
+})();
@@ -1,151 +1,4176 @@
 #include <node_api.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+    #define RTSP_X86_64 1
+    #include <immintrin.h>
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+        #define RTSP_TARGET_AVX2
+    #else
+        #define RTSP_TARGET_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
 
 extern "C" {
     #include "libavcodec/avcodec.h"
     #include "libavformat/avformat.h"
     #include "libswscale/swscale.h"
     #include "libavutil/imgutils.h"
+    #include "libavutil/pixdesc.h"
+    #include "libavutil/time.h"
 }
 
-class AVContext {
+class FramePool;
+
+// A frame buffer handed to JS. It returns to its pool when the Buffer is
+// garbage collected or when JS calls release() on it, whichever is first.
+struct FrameLease {
+    std::shared_ptr<FramePool> pool;
+    int slot = -1;
+    uint8_t* data = NULL;
+    size_t size = 0;
+};
+
+// Preallocated, aligned output buffers for one stream. When every slot is
+// out in JS, acquire() falls back to a one-off allocation and counts it.
+class FramePool : public std::enable_shared_from_this<FramePool> {
 public:
-    AVContext(){}
+    FramePool(int count, size_t size) : _size(size) {
+        for (int i = 0; i < count; i++) {
+            uint8_t* data = (uint8_t *)av_malloc(size);
+            if (!data) {
+                break;
+            }
+            _slots.push_back(Slot{ data, NULL });
+            _free.push_back(i);
+        }
+    }
     
-    int open(const char* url) {
-        avformat_network_init();
-        format_ctx = avformat_alloc_context();
-
-        AVDictionary* options = NULL;
-        av_dict_set(&options, "max_delay", "10000", 0);
-        av_dict_set(&options, "buffer_size", "1024000", 0);
-        av_dict_set(&options, "rtsp_transport", "tcp", 0);
-        av_dict_set(&options, "analyzeduration", "1000000", 0);
-        av_dict_set(&options, "stimeout","10000000", 0);
-        
-        if (avformat_open_input(&format_ctx, url, NULL, &options) != 0) {
-           printf("%s failed!\n", "avformat_open_input");
-           return -1;
+    ~FramePool(){
+        for (size_t i = 0; i < _slots.size(); i++) {
+            av_free(_slots[i].data);
         }
+    }
+    
+    FrameLease* acquire() {
+        FrameLease* lease = new FrameLease();
+        lease->pool = shared_from_this();
+        lease->size = _size;
         
-        if (avformat_find_stream_info(format_ctx, NULL) < 0) {
-           printf("%s failed!\n", "avformat_find_stream_info");
-           return -1;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _acquired++;
+        if (!_free.empty()) {
+            lease->slot = _free.back();
+            _free.pop_back();
+            _slots[lease->slot].lease = lease;
+            lease->data = _slots[lease->slot].data;
+            return lease;
         }
         
-        av_dump_format(format_ctx, 0, NULL, 0);
+        _exhausted++;
+        lease->data = (uint8_t *)av_malloc(_size);
+        if (!lease->data) {
+            delete lease;
+            return NULL;
+        }
+        return lease;
+    }
+    
+    // Gives the lease's memory back. A no-op if JS already released it.
+    void release(FrameLease* lease) {
+        if (lease->slot < 0) {
+            av_free(lease->data);
+            lease->data = NULL;
+            return;
+        }
         
-        video_index = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
-        if(video_index < 0){
-           printf("%s failed!\n", "av_find_best_stream");
-           return -1;
+        std::lock_guard<std::mutex> lock(_mutex);
+        Slot& slot = _slots[lease->slot];
+        if (slot.lease == lease) {
+            slot.lease = NULL;
+            _free.push_back(lease->slot);
         }
+    }
+    
+    // Explicit release from JS, by the Buffer's data pointer.
+    bool release(const void* data) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < _slots.size(); i++) {
+            if (_slots[i].data == data && _slots[i].lease) {
+                _slots[i].lease = NULL;
+                _free.push_back((int)i);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    size_t size() const { return _size; }
+    
+    struct Stats {
+        int slots;
+        int free;
+        uint64_t acquired;
+        uint64_t exhausted;
+    };
+    
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return Stats{ (int)_slots.size(), (int)_free.size(), _acquired, _exhausted };
+    }
+    
+private:
+    struct Slot {
+        uint8_t* data;
+        FrameLease* lease;
+    };
+    
+    std::mutex _mutex;
+    size_t _size;
+    std::vector<Slot> _slots;
+    std::vector<int> _free;
+    uint64_t _acquired = 0;
+    uint64_t _exhausted = 0;
+};
 
-        codec_ctx = avcodec_alloc_context3(NULL);
-        avcodec_parameters_to_context(codec_ctx, format_ctx->streams[video_index]->codecpar);
+// Output formats accepted by open(); "native" hands out the decoder's planes.
+struct PixelFormatName {
+    const char* name;
+    AVPixelFormat format;
+};
 
-        codec = avcodec_find_decoder(codec_ctx->codec_id);
-        if(avcodec_open2(codec_ctx, codec, NULL)<0){
-           printf("%s failed!\n", "avcodec_open2");
-           return -1;
+static const PixelFormatName pixel_formats[] = {
+    { "rgb32", AV_PIX_FMT_RGB32 },
+    { "rgb24", AV_PIX_FMT_RGB24 },
+    { "bgr24", AV_PIX_FMT_BGR24 },
+    { "gray8", AV_PIX_FMT_GRAY8 },
+    { "nv12", AV_PIX_FMT_NV12 },
+    { "yuv420p", AV_PIX_FMT_YUV420P },
+    { "native", AV_PIX_FMT_NONE }
+};
+
+// The option name of an output format, so results report what was asked
+// for ("rgb32", not FFmpeg's "bgra").
+static const char* FormatName(AVPixelFormat format) {
+    for (size_t i = 0; i < sizeof(pixel_formats) / sizeof(pixel_formats[0]); i++) {
+        if (pixel_formats[i].format == format && format != AV_PIX_FMT_NONE) {
+            return pixel_formats[i].name;
+        }
+    }
+    return av_get_pix_fmt_name(format);
+}
+
+struct ScalerName {
+    const char* name;
+    int flags;
+};
+
+static const ScalerName scalers[] = {
+    { "fast_bilinear", SWS_FAST_BILINEAR },
+    { "bilinear", SWS_BILINEAR },
+    { "bicubic", SWS_BICUBIC },
+    { "area", SWS_AREA }
+};
+
+struct ThreadTypeName {
+    const char* name;
+    int type;
+};
+
+static const ThreadTypeName thread_types[] = {
+    { "frame", FF_THREAD_FRAME },
+    { "slice", FF_THREAD_SLICE },
+    { "auto", FF_THREAD_FRAME | FF_THREAD_SLICE }
+};
+
+struct DiscardName {
+    const char* name;
+    AVDiscard discard;
+};
+
+static const DiscardName discards[] = {
+    { "none", AVDISCARD_DEFAULT },
+    { "nonref", AVDISCARD_NONREF },
+    { "bidir", AVDISCARD_BIDIR },
+    { "nonintra", AVDISCARD_NONINTRA },
+    { "nonkey", AVDISCARD_NONKEY }
+};
+
+// Latency histogram with power-of-two microsecond buckets: bucket b holds
+// values below 2^b. Recording is a few relaxed atomic operations, so it
+// stays on in production and can be read from any thread.
+class Histogram {
+public:
+    static const int BUCKETS = 32;
+    
+    void record(int64_t us) {
+        if (us < 0) {
+            us = 0;
         }
+        int bucket = 0;
+        for (int64_t v = us; v > 0 && bucket < BUCKETS - 1; v >>= 1) {
+            bucket++;
+        }
+        _counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        _sum.fetch_add(us, std::memory_order_relaxed);
         
-        frame = av_frame_alloc();
-        packet=(AVPacket *)av_malloc(sizeof(AVPacket));
-        av_new_packet(packet, codec_ctx->width * codec_ctx->height);
+        int64_t max = _max.load(std::memory_order_relaxed);
+        while (us > max && !_max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+        }
+    }
+    
+    struct Summary {
+        uint64_t count;
+        double mean;
+        int64_t p50;
+        int64_t p90;
+        int64_t p99;
+        int64_t max;
+    };
+    
+    // Percentiles are reported as the upper bound of their bucket.
+    Summary summary() const {
+        uint64_t counts[BUCKETS];
+        uint64_t count = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i] = _counts[i].load(std::memory_order_relaxed);
+            count += counts[i];
+        }
+        
+        Summary summary = { count, 0, 0, 0, 0, _max.load(std::memory_order_relaxed) };
+        if (count == 0) {
+            return summary;
+        }
+        summary.mean = (double)_sum.load(std::memory_order_relaxed) / count;
+        summary.p50 = percentile(counts, count, 0.50);
+        summary.p90 = percentile(counts, count, 0.90);
+        summary.p99 = percentile(counts, count, 0.99);
+        return summary;
+    }
+    
+    void reset() {
+        for (int i = 0; i < BUCKETS; i++) {
+            _counts[i].store(0, std::memory_order_relaxed);
+        }
+        _sum.store(0, std::memory_order_relaxed);
+        _max.store(0, std::memory_order_relaxed);
+    }
+    
+private:
+    int64_t percentile(const uint64_t* counts, uint64_t count, double p) const {
+        uint64_t rank = (uint64_t)(p * count);
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen > rank) {
+                int64_t bound = ((int64_t)1 << i) - 1;
+                int64_t max = _max.load(std::memory_order_relaxed);
+                return bound < max ? bound : max;
+            }
+        }
+        return _max.load(std::memory_order_relaxed);
+    }
+    
+    std::atomic<uint64_t> _counts[BUCKETS] = {};
+    std::atomic<int64_t> _sum{0};
+    std::atomic<int64_t> _max{0};
+};
 
-        out_frame = av_frame_alloc();
-       
-        out_buffer_size = av_image_get_buffer_size(AV_PIX_FMT_RGB32, codec_ctx->width, codec_ctx->height, 1);
-        out_buffer = (uint8_t *)av_malloc(out_buffer_size);
-        av_image_fill_arrays(out_frame->data, out_frame->linesize, out_buffer, AV_PIX_FMT_RGB32, codec_ctx->width, codec_ctx->height, 1);
+// What a stream has done and where it spends its time. Written by the
+// stream's worker and the JS thread, read from JS at any time.
+struct StreamStats {
+    Histogram demux;
+    Histogram decode;
+    Histogram convert;
+    Histogram deliver;
+    Histogram jitter;
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> bytes_copied{0};
+    std::atomic<uint64_t> frames_decoded{0};
+    std::atomic<uint64_t> frames_delivered{0};
+    std::atomic<uint64_t> frames_dropped{0};
+    std::atomic<uint64_t> recorder_dropped{0};
+    std::atomic<uint64_t> frames_still{0};
+    std::atomic<uint64_t> reconnects{0};
+    std::atomic<int64_t> time_to_first_frame{0};
+    std::atomic<int> width{0};
+    std::atomic<int> height{0};
+    std::atomic<int> codec_id{AV_CODEC_ID_NONE};
+    
+    void reset() {
+        demux.reset();
+        decode.reset();
+        convert.reset();
+        deliver.reset();
+        jitter.reset();
+        packets = 0;
+        bytes_in = 0;
+        bytes_out = 0;
+        bytes_copied = 0;
+        frames_decoded = 0;
+        frames_delivered = 0;
+        frames_dropped = 0;
+        recorder_dropped = 0;
+        frames_still = 0;
+        reconnects = 0;
+        time_to_first_frame = 0;
+        width = 0;
+        height = 0;
+        codec_id = AV_CODEC_ID_NONE;
+    }
+};
 
-        img_convert_ctx = sws_getContext(codec_ctx->width, codec_ctx->height,
-                                       codec_ctx->pix_fmt, codec_ctx->width, codec_ctx->height,
-                                       AV_PIX_FMT_RGB32, SWS_BICUBIC, NULL, NULL, NULL);
+// Settings of the `record` option.
+struct RecordOptions {
+    std::string path;
+    std::string format = "mp4";
+    int segment = 60;
+    bool strftime = false;
+};
+
+// Optional per-frame trace, enabled with open(url, { trace: entries }).
+// Each entry is pts (s), then packet arrival, decode done (the frame left
+// the decoder, before any conversion) and delivery times (monotonic us).
+// Only the JS thread touches it.
+class FrameTrace {
+public:
+    static const int FIELDS = 4;
+    
+    void reset(int entries) {
+        _entries.assign((size_t)entries * FIELDS, 0);
+        _next = 0;
+        _count = 0;
+    }
+    
+    void add(double pts, int64_t received, int64_t decoded, int64_t delivered) {
+        if (_entries.empty()) {
+            return;
+        }
+        double* entry = &_entries[_next * FIELDS];
+        entry[0] = pts;
+        entry[1] = (double)received;
+        entry[2] = (double)decoded;
+        entry[3] = (double)delivered;
+        _next = (_next + 1) % (_entries.size() / FIELDS);
+        if (_count < _entries.size() / FIELDS) {
+            _count++;
+        }
+    }
+    
+    // Copies the entries out, oldest first.
+    void copy(double* out) const {
+        size_t capacity = _entries.size() / FIELDS;
+        size_t first = (_next + capacity - _count) % (capacity ? capacity : 1);
+        for (size_t i = 0; i < _count; i++) {
+            memcpy(out + i * FIELDS, &_entries[((first + i) % capacity) * FIELDS], FIELDS * sizeof(double));
+        }
+    }
+    
+    size_t count() const { return _count; }
+    
+private:
+    std::vector<double> _entries;
+    size_t _next = 0;
+    size_t _count = 0;
+};
 
+struct DropPolicyName {
+    const char* name;
+    int policy;
+};
+
+// Values match FrameQueue::Policy.
+static const DropPolicyName drop_policies[] = {
+    { "drop-oldest", 0 },
+    { "latest", 1 },
+    { "block", 2 }
+};
+
+// Settings of the `reconnect` option; delays are in milliseconds and
+// retries < 0 means forever.
+struct ReconnectOptions {
+    bool enabled = false;
+    int retries = -1;
+    int delay = 500;
+    int max_delay = 30000;
+};
+
+// One entry of the `outputs` option: a size, layout and scaler that every
+// decoded frame is also converted to. A missing dimension follows the
+// source aspect ratio. JPEG profiles scale to full-range YUV 4:2:0 and
+// encode that, at a quality from 1 to 100.
+struct OutputOptions {
+    int width = 0;
+    int height = 0;
+    AVPixelFormat format = AV_PIX_FMT_RGB32;
+    int scaler = SWS_BICUBIC;
+    bool jpeg = false;
+    int quality = 80;
+};
+
+// A region of the picture in fractions of its width and height.
+struct Region {
+    double x;
+    double y;
+    double width;
+    double height;
+};
+
+// Settings of the `motion` option. A block is active when its mean
+// absolute luma difference from the reference exceeds block_threshold
+// (0-255); the score is the fraction of active blocks within the ROI.
+struct MotionOptions {
+    bool enabled = false;
+    double threshold = 0.01;
+    int block_threshold = 12;
+    double scene_threshold = 0.6;
+    std::vector<Region> roi;
+};
+
+// Per-stream settings passed as the second argument of open().
+struct StreamOptions {
+    int pool_size = 4;
+    int threads = 0;
+    int thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    bool nonblock = false;
+    int timeout = 10000;
+    AVDiscard skip = AVDISCARD_DEFAULT;
+    int every = 1;
+    double max_fps = 0;
+    int width = 0;
+    int height = 0;
+    AVPixelFormat format = AV_PIX_FMT_RGB32;
+    bool passthrough = false;
+    bool jpeg = false;
+    int quality = 80;
+    int scaler = SWS_BICUBIC;
+    bool packets = false;
+    RecordOptions record;
+    int queue_size = 0;
+    int drop_policy = 0;
+    int max_latency = 0;
+    int trace = 0;
+    bool probe = true;
+    int probesize = 0;
+    int analyzeduration = 1000000;
+    int fpsprobesize = -1;
+    bool verbose = false;
+    ReconnectOptions reconnect;
+    std::vector<OutputOptions> outputs;
+    MotionOptions motion;
+};
+
+// Stream-copies the input's audio and video into rolling segments on
+// disk, using libavformat's segment muxer. Packets are queued by
+// reference from the demux thread and written by the Remuxer's own
+// thread, so slow disks never hold up the stream.
+class Remuxer {
+public:
+    // Packets that may wait for the disk before new ones are dropped.
+    static const size_t MAX_QUEUED = 1024;
+    
+    // Drops, whether the queue was full or the write failed, are counted
+    // in `dropped`, which outlives the Remuxer.
+    explicit Remuxer(std::atomic<uint64_t>& dropped) : dropped(dropped) {}
+    
+    ~Remuxer(){ close(); }
+    
+    int open(AVFormatContext* input, const RecordOptions& record) {
+        if (avformat_alloc_output_context2(&output, NULL, "segment", record.path.c_str()) < 0) {
+           printf("%s failed!\n", "avformat_alloc_output_context2");
+           return -1;
+        }
+        
+        // Streams the segment format cannot hold, such as G.711 audio in
+        // mp4, are left out rather than failing the whole recording.
+        const char* segment_format = record.format == "fmp4" ? "mp4" : record.format.c_str();
+        AVOutputFormat* format = av_guess_format(segment_format, NULL, NULL);
+        
+        for (unsigned int i = 0; i < input->nb_streams; i++) {
+            AVCodecParameters* codecpar = input->streams[i]->codecpar;
+            
+            if (codecpar->codec_type != AVMEDIA_TYPE_VIDEO && codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+                continue;
+            }
+            if (format && avformat_query_codec(format, codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0) {
+                printf("Remuxer: %s cannot hold %s, not recording stream %u\n",
+                       segment_format, avcodec_get_name(codecpar->codec_id), i);
+                continue;
+            }
+            
+            AVStream* stream = avformat_new_stream(output, NULL);
+            if (!stream || avcodec_parameters_copy(stream->codecpar, codecpar) < 0) {
+               printf("%s failed!\n", "avformat_new_stream");
+               return -1;
+            }
+            stream->codecpar->codec_tag = 0;
+            stream->time_base = input->streams[i]->time_base;
+            if (codecpar->codec_type == AVMEDIA_TYPE_VIDEO && video_index < 0) {
+                video_index = stream->index;
+            }
+        }
+        if (output->nb_streams == 0) {
+           printf("%s failed!\n", "Remuxer::open");
+           return -1;
+        }
+        remap(input);
+        
+        AVDictionary* options = NULL;
+        char segment_time[16];
+        snprintf(segment_time, sizeof(segment_time), "%d", record.segment);
+        av_dict_set(&options, "segment_time", segment_time, 0);
+        av_dict_set(&options, "reset_timestamps", "1", 0);
+        if (record.strftime) {
+            av_dict_set(&options, "strftime", "1", 0);
+        }
+        if (record.format == "fmp4") {
+            av_dict_set(&options, "segment_format", "mp4", 0);
+            av_dict_set(&options, "segment_format_options", "movflags=+frag_keyframe+empty_moov+default_base_moof", 0);
+        } else {
+            av_dict_set(&options, "segment_format", record.format.c_str(), 0);
+        }
+        
+        int ret = avformat_write_header(output, &options);
+        av_dict_free(&options);
+        if (ret < 0) {
+           printf("%s failed!\n", "avformat_write_header");
+           return -1;
+        }
+        
+        _thread = std::thread(&Remuxer::run, this);
         return 0;
     }
     
-    int read() {
-        if(av_read_frame(format_ctx, packet) < 0) {
-            av_packet_unref(packet);
-            printf("%s failed!\n", "av_read_frame");
-            return -2;
+    // Queues a reference to packet; called on the demux thread. The
+    // queued copy already carries its output stream and time base, so a
+    // remap() never affects packets still waiting for the disk.
+    void write(const AVPacket* packet) {
+        if (packet->stream_index < 0 || packet->stream_index >= (int)mapping.size() || mapping[packet->stream_index] < 0) {
+            return;
         }
         
-        if(packet->stream_index != video_index) {
-            av_packet_unref(packet);
-            return -1;
+        AVPacket* ref = av_packet_clone(packet);
+        if (!ref) {
+            dropped++;
+            return;
         }
+        Queued queued = { ref, time_bases[packet->stream_index] };
+        ref->stream_index = mapping[packet->stream_index];
         
-        if (avcodec_send_packet(codec_ctx, packet) < 0) {
-            av_packet_unref(packet);
-            return -1;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_queue.size() >= MAX_QUEUED) {
+                av_packet_free(&ref);
+                dropped++;
+                return;
+            }
+            _queue.push_back(queued);
+        }
+        _cond.notify_one();
+    }
+    
+    // The input was reopened: its streams are matched up with the output
+    // again, and its timestamps start over. The restart is queued in order
+    // with the packets, as an entry without one.
+    void discontinuity(AVFormatContext* input) {
+        remap(input);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.push_back(Queued{ NULL, AVRational{ 0, 1 } });
+        }
+        _cond.notify_one();
+    }
+    
+    // Writes what is queued, finishes the last segment and frees everything.
+    void close() {
+        if (_thread.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopped = true;
+            }
+            _cond.notify_one();
+            _thread.join();
+            av_write_trailer(output);
         }
         
-        if (avcodec_receive_frame(codec_ctx, frame) < 0) {
-            av_packet_unref(packet);
-            return -1;
+        for (size_t i = 0; i < _queue.size(); i++) {
+            if (_queue[i].packet) {
+                av_packet_free(&_queue[i].packet);
+            }
+        }
+        _queue.clear();
+        
+        if (output) {
+            avformat_free_context(output);
+            output = NULL;
+        }
+    }
+    
+private:
+    struct Queued {
+        AVPacket* packet;
+        AVRational time_base;
+    };
+    
+    // Maps each input stream to the first unused output stream of the same
+    // type and codec; the rest are not recorded. Demux thread only.
+    void remap(AVFormatContext* input) {
+        std::vector<bool> used(output->nb_streams, false);
+        mapping.assign(input->nb_streams, -1);
+        time_bases.assign(input->nb_streams, AVRational{ 0, 1 });
+        
+        for (unsigned int i = 0; i < input->nb_streams; i++) {
+            AVCodecParameters* codecpar = input->streams[i]->codecpar;
+            time_bases[i] = input->streams[i]->time_base;
+            for (unsigned int j = 0; j < output->nb_streams; j++) {
+                AVCodecParameters* recorded = output->streams[j]->codecpar;
+                if (!used[j] && recorded->codec_type == codecpar->codec_type && recorded->codec_id == codecpar->codec_id) {
+                    mapping[i] = (int)j;
+                    used[j] = true;
+                    break;
+                }
+            }
+        }
+    }
+    
+    void run() {
+        for (;;) {
+            Queued queued;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cond.wait(lock, [this]{ return _stopped || !_queue.empty(); });
+                if (_queue.empty()) {
+                    return;
+                }
+                queued = _queue.front();
+                _queue.pop_front();
+            }
+            
+            if (!queued.packet) {
+                resync = true;
+                keyframe_seen = false;
+                continue;
+            }
+            
+            mux(queued.packet, queued.time_base);
+            av_packet_free(&queued.packet);
+        }
+    }
+    
+    // packet's stream_index is already the output stream's.
+    void mux(AVPacket* packet, AVRational time_base) {
+        // Segments must start on a keyframe.
+        if (!keyframe_seen) {
+            if (packet->stream_index != video_index || !(packet->flags & AV_PKT_FLAG_KEY)) {
+                return;
+            }
+            keyframe_seen = true;
+        }
+        
+        if (packet->dts == AV_NOPTS_VALUE) {
+            packet->dts = packet->pts;
+        }
+        if (packet->dts == AV_NOPTS_VALUE) {
+            return;
+        }
+        
+        // After a reconnect, shift the new session's timestamps to carry on
+        // one frame after the last packet written.
+        int64_t dts = av_rescale_q(packet->dts, time_base, AV_TIME_BASE_Q);
+        if (resync) {
+            resync = false;
+            int64_t gap = packet->duration > 0 ? av_rescale_q(packet->duration, time_base, AV_TIME_BASE_Q) : 40000;
+            offset = last_dts + gap - dts;
+        }
+        if (offset) {
+            int64_t shift = av_rescale_q(offset, AV_TIME_BASE_Q, time_base);
+            packet->dts += shift;
+            if (packet->pts != AV_NOPTS_VALUE) {
+                packet->pts += shift;
+            }
+        }
+        last_dts = dts + offset;
+        
+        AVStream* stream = output->streams[packet->stream_index];
+        av_packet_rescale_ts(packet, time_base, stream->time_base);
+        packet->pos = -1;
+        
+        if (av_interleaved_write_frame(output, packet) < 0) {
+            dropped++;
         }
+    }
+    
+public:
+    AVFormatContext* output = NULL;
+    std::vector<int> mapping;
+    std::vector<AVRational> time_bases;
+    int video_index = -1;
+    bool keyframe_seen = false;
+    bool resync = false;
+    int64_t offset = 0;
+    int64_t last_dts = 0;
+    std::atomic<uint64_t>& dropped;
+    
+private:
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Queued> _queue;
+    bool _stopped = false;
+    std::thread _thread;
+};
 
-        if (sws_scale(img_convert_ctx,
-                        (const unsigned char* const*)frame->data, 
-                        frame->linesize, 
-                        0, 
-                        codec_ctx->height,
-                        out_frame->data, 
-                        out_frame->linesize) < 0){
-            return -1;
+// Sums of absolute differences between two rows, one per 32-pixel block:
+// sums[i] += SAD(a[32i .. 32i+31], b[32i .. 32i+31]).
+typedef void (*SadBlocksFn)(const uint8_t* a, const uint8_t* b, int blocks, uint32_t* sums);
+
+#ifdef RTSP_X86_64
+static void SadBlocksSse2(const uint8_t* a, const uint8_t* b, int blocks, uint32_t* sums) {
+    for (int i = 0; i < blocks; i++) {
+        __m128i lo = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+        __m128i hi = _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + 16)), _mm_loadu_si128((const __m128i*)(b + 16)));
+        __m128i sum = _mm_add_epi64(lo, hi);
+        sums[i] += (uint32_t)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+        a += 32;
+        b += 32;
+    }
+}
+
+RTSP_TARGET_AVX2
+static void SadBlocksAvx2(const uint8_t* a, const uint8_t* b, int blocks, uint32_t* sums) {
+    for (int i = 0; i < blocks; i++) {
+        __m256i sad = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)a), _mm256_loadu_si256((const __m256i*)b));
+        __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sad), _mm256_extracti128_si256(sad, 1));
+        sums[i] += (uint32_t)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+        a += 32;
+        b += 32;
+    }
+}
+
+static bool HasAvx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#else
+static void SadBlocksScalar(const uint8_t* a, const uint8_t* b, int blocks, uint32_t* sums) {
+    for (int i = 0; i < blocks; i++) {
+        uint32_t sum = 0;
+        for (int j = 0; j < 32; j++) {
+            int d = a[j] - b[j];
+            sum += d < 0 ? -d : d;
         }
+        sums[i] += sum;
+        a += 32;
+        b += 32;
+    }
+}
+#endif
 
-        av_packet_unref(packet);
+// Picks the widest SAD the CPU runs; SSE2 is always there on x86-64.
+static SadBlocksFn SadBlocks() {
+#ifdef RTSP_X86_64
+    static const SadBlocksFn fn = HasAvx2() ? SadBlocksAvx2 : SadBlocksSse2;
+    return fn;
+#else
+    return SadBlocksScalar;
+#endif
+}
 
-        return 0;
+// Scores decoded frames for motion before anything else is done with
+// them. The luma plane is compared with a reference in 32x32 blocks,
+// sampling every 4th row, and the reference moves on only with delivered
+// frames so that slow changes add up until they pass the threshold.
+class MotionGate {
+public:
+    static const int BLOCK = 32;
+    static const int ROW_STEP = 4;
+    
+    void reset() {
+        _width = 0;
+        _height = 0;
+        _reference.clear();
+        score = NAN;
+        scene = false;
+        columns = 0;
+        rows = 0;
+        activity.clear();
     }
     
-    void close() {
-        if (frame) { 
-            av_frame_free(&frame); 
-            frame = NULL;
+    // Returns false when the frame shows too little change to deliver.
+    // Frames whose luma is not 8-bit planar always pass, unscored.
+    bool check(const AVFrame* frame, const MotionOptions& options) {
+        const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+        if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_HWACCEL)) ||
+            !(desc->flags & AV_PIX_FMT_FLAG_PLANAR) || desc->comp[0].depth != 8 ||
+            desc->comp[0].plane != 0 || desc->comp[0].step != 1) {
+            score = NAN;
+            return true;
         }
-
-        if (format_ctx) { 
-            avformat_close_input(&format_ctx); 
-            format_ctx = NULL;
+        
+        // New geometry: start over with this frame as the reference.
+        if (frame->width != _width || frame->height != _height) {
+            setup(frame->width, frame->height, options);
+            keep(frame);
+            score = 1;
+            scene = true;
+            std::fill(activity.begin(), activity.end(), (uint8_t)255);
+            return true;
+        }
+        
+        SadBlocksFn sad = SadBlocks();
+        int full = _width / BLOCK;
+        int tail = _width % BLOCK;
+        std::vector<uint32_t> sums(columns);
+        
+        int active = 0;
+        int masked = 0;
+        for (int r = 0; r < rows; r++) {
+            std::fill(sums.begin(), sums.end(), 0);
+            int samples = 0;
+            for (int y = r * BLOCK; y < (r + 1) * BLOCK && y < _height; y += ROW_STEP) {
+                const uint8_t* a = frame->data[0] + (ptrdiff_t)y * frame->linesize[0];
+                const uint8_t* b = &_reference[(size_t)(y / ROW_STEP) * _width];
+                sad(a, b, full, &sums[0]);
+                for (int x = full * BLOCK; x < _width; x++) {
+                    int d = a[x] - b[x];
+                    sums[full] += d < 0 ? -d : d;
+                }
+                samples++;
+            }
+            
+            for (int c = 0; c < columns; c++) {
+                int pixels = samples * (c < full ? BLOCK : tail);
+                uint32_t mean = pixels ? sums[c] / pixels : 0;
+                uint8_t value = (uint8_t)(mean > 255 ? 255 : mean);
+                activity[r * columns + c] = value;
+                if (_mask[r * columns + c]) {
+                    masked++;
+                    if (value > options.block_threshold) {
+                        active++;
+                    }
+                }
+            }
+        }
+        
+        score = masked ? (double)active / masked : 0;
+        scene = score >= options.scene_threshold;
+        if (score < options.threshold) {
+            return false;
+        }
+        keep(frame);
+        return true;
+    }
+    
+public:
+    double score = NAN;
+    bool scene = false;
+    int columns = 0;
+    int rows = 0;
+    std::vector<uint8_t> activity;
+    
+private:
+    // Sizes the block grid and turns the ROI into a block mask; a block
+    // counts when its center lies inside any region.
+    void setup(int width, int height, const MotionOptions& options) {
+        _width = width;
+        _height = height;
+        _reference.assign((size_t)((height + ROW_STEP - 1) / ROW_STEP) * width, 0);
+        columns = (width + BLOCK - 1) / BLOCK;
+        rows = (height + BLOCK - 1) / BLOCK;
+        activity.assign((size_t)columns * rows, 0);
+        _mask.assign((size_t)columns * rows, options.roi.empty() ? 1 : 0);
+        
+        for (size_t i = 0; i < options.roi.size(); i++) {
+            const Region& region = options.roi[i];
+            for (int r = 0; r < rows; r++) {
+                for (int c = 0; c < columns; c++) {
+                    double x = (c * BLOCK + BLOCK / 2.0) / width;
+                    double y = (r * BLOCK + BLOCK / 2.0) / height;
+                    if (x >= region.x && x < region.x + region.width &&
+                        y >= region.y && y < region.y + region.height) {
+                        _mask[r * columns + c] = 1;
+                    }
+                }
+            }
+        }
+    }
+    
+    void keep(const AVFrame* frame) {
+        for (int y = 0; y < _height; y += ROW_STEP) {
+            memcpy(&_reference[(size_t)(y / ROW_STEP) * _width], frame->data[0] + (ptrdiff_t)y * frame->linesize[0], _width);
+        }
+    }
+    
+    int _width = 0;
+    int _height = 0;
+    std::vector<uint8_t> _reference;
+    std::vector<uint8_t> _mask;
+};
+
+// A ring of fixed-size frame slots in memory shared with JS, a
+// SharedArrayBuffer, so that any number of worker_threads can read
+// published frames in place. Layout, in 32-bit words unless noted:
+//
+//   ring header, 64 bytes: [0] slot count, [1] slot size in bytes,
+//     [2] slot header size, [3] published: the newest frame's sequence
+//     number, 0 before the first
+//   slot i at 64 + i * slot size: a 64-byte header, then the image
+//     [0] seq: 0 while being written, else the frame's sequence number,
+//     [1] width, [2] height, [3] image size in bytes, [4..7] strides,
+//     bytes 32-39 pts in seconds (float64, NaN when unknown),
+//     bytes 40-55 format name, NUL-padded
+//
+// Frame n goes to slot (n - 1) % slot count. Readers check the slot's seq
+// before and after using it; a change means the writer lapped them.
+class FrameRing {
+public:
+    static const int HEADER = 64;
+    
+    FrameRing(uint8_t* data, size_t size, int slots) : _data(data), _slots(slots) {
+        _slot_size = slots > 0 && size > HEADER ? (int)(((size - HEADER) / slots) & ~(size_t)63) : 0;
+        word(_data, 0)->store(_slot_size > HEADER ? _slots : 0);
+        word(_data, 1)->store(_slot_size);
+        word(_data, 2)->store(HEADER);
+        word(_data, 3)->store(0);
+        for (int i = 0; _slot_size > HEADER && i < _slots; i++) {
+            word(slot(i), 0)->store(0);
+        }
+    }
+    
+    bool valid() const { return _slot_size > HEADER; }
+    
+    // Claims the next slot for an image of `size` bytes and marks it as
+    // being written. Returns NULL when the image does not fit.
+    uint8_t* begin(int size, int32_t* seq, int* index) {
+        if (size > _slot_size - HEADER) {
+            return NULL;
+        }
+        *seq = ++_seq;
+        *index = (*seq - 1) % _slots;
+        // Seqlock writer: the 0 must be visible before any image byte.
+        word(slot(*index), 0)->store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        return slot(*index) + HEADER;
+    }
+    
+    // Fills in the slot header and publishes the frame.
+    void commit(int index, int32_t seq, int width, int height, AVPixelFormat format, int size, double pts) {
+        uint8_t* header = slot(index);
+        int linesize[4] = { 0, 0, 0, 0 };
+        av_image_fill_linesizes(linesize, format, width);
+        
+        word(header, 1)->store(width, std::memory_order_relaxed);
+        word(header, 2)->store(height, std::memory_order_relaxed);
+        word(header, 3)->store(size, std::memory_order_relaxed);
+        for (int i = 0; i < 4; i++) {
+            word(header, 4 + i)->store(linesize[i], std::memory_order_relaxed);
+        }
+        memcpy(header + 32, &pts, sizeof(pts));
+        memset(header + 40, 0, 16);
+        const char* name = FormatName(format);
+        if (name) {
+            strncpy((char*)header + 40, name, 15);
+        }
+        
+        word(header, 0)->store(seq);
+        word(_data, 3)->store(seq);
+    }
+    
+private:
+    static std::atomic<int32_t>* word(uint8_t* base, int index) {
+        static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t), "int32 atomics must be plain words");
+        return reinterpret_cast<std::atomic<int32_t>*>(base) + index;
+    }
+    
+    uint8_t* slot(int index) { return _data + HEADER + (size_t)index * _slot_size; }
+    
+    uint8_t* _data;
+    int _slots;
+    int _slot_size = 0;
+    int32_t _seq = 0;
+};
+
+// Scalers of one stream, keyed on source and destination geometry, so a
+// stream that flips between resolutions gets its earlier scalers back
+// instead of new ones. An entry is handed to one profile at a time, since
+// a SwsContext cannot run two conversions at once: profiles with the same
+// key that convert concurrently each get, and keep reusing, their own.
+class ScalerCache {
+public:
+    static const size_t MAX_IDLE = 8;
+    
+    struct Key {
+        int src_width;
+        int src_height;
+        int src_format;
+        int dst_width;
+        int dst_height;
+        int dst_format;
+        int flags;
+        
+        bool operator==(const Key& other) const {
+            return memcmp(this, &other, sizeof(Key)) == 0;
+        }
+    };
+    
+    ScalerCache(){}
+    ScalerCache(const ScalerCache&) = delete;
+    ScalerCache& operator=(const ScalerCache&) = delete;
+    
+    ~ScalerCache(){ clear(); }
+    
+    SwsContext* get(const Key& key) {
+        for (size_t i = 0; i < _entries.size(); i++) {
+            if (!_entries[i].busy && _entries[i].key == key) {
+                _entries[i].busy = true;
+                return _entries[i].context;
+            }
+        }
+        
+        SwsContext* context = sws_getContext(key.src_width, key.src_height, (AVPixelFormat)key.src_format,
+                                             key.dst_width, key.dst_height, (AVPixelFormat)key.dst_format,
+                                             key.flags, NULL, NULL, NULL);
+        if (!context) {
+            printf("%s failed!\n", "sws_getContext");
+            return NULL;
+        }
+        _entries.push_back(Entry{ key, context, true, 0 });
+        return context;
+    }
+    
+    // Takes back a scaler from get(). Beyond MAX_IDLE idle entries, the
+    // one returned longest ago is freed.
+    void put(SwsContext* context) {
+        size_t idle = 0;
+        for (size_t i = 0; i < _entries.size(); i++) {
+            if (_entries[i].context == context) {
+                _entries[i].busy = false;
+                _entries[i].returned = ++_returns;
+            }
+            if (!_entries[i].busy) {
+                idle++;
+            }
+        }
+        
+        while (idle > MAX_IDLE) {
+            size_t oldest = _entries.size();
+            for (size_t i = 0; i < _entries.size(); i++) {
+                if (!_entries[i].busy && (oldest == _entries.size() || _entries[i].returned < _entries[oldest].returned)) {
+                    oldest = i;
+                }
+            }
+            sws_freeContext(_entries[oldest].context);
+            _entries.erase(_entries.begin() + oldest);
+            idle--;
+        }
+    }
+    
+    void clear() {
+        for (size_t i = 0; i < _entries.size(); i++) {
+            sws_freeContext(_entries[i].context);
+        }
+        _entries.clear();
+    }
+    
+private:
+    struct Entry {
+        Key key;
+        SwsContext* context;
+        bool busy;
+        uint64_t returned;
+    };
+    
+    std::vector<Entry> _entries;
+    uint64_t _returns = 0;
+};
+
+// One output size/format of a stream, resolved against the current source
+// geometry. Its buffers come from the stream's pool at the same index.
+struct OutputProfile {
+    OutputOptions settings;
+    int width = 0;
+    int height = 0;
+    int buffer_size = 0;
+    SwsContext* scaler = NULL;
+    AVFrame* yuv = NULL;
+};
+
+class AVContext {
+public:
+    // Upper bound on the `outputs` option.
+    static const int MAX_OUTPUTS = 8;
+    
+    AVContext(){}
+    
+    // Opens url from a clean state; on failure everything is released
+    // again, so callers only ever see a fully open or a closed context.
+    int open(const char* url) {
+        close();
+        int ret = open_stream(url);
+        if (ret < 0) {
+            close();
+        }
+        return ret;
+    }
+    
+    int open_stream(const char* url) {
+        aborted = false;
+        stats.reset();
+        gate.reset();
+        this->url = url;
+        
+        // Without `outputs`, the top-level size and format make up the
+        // only profile.
+        release_outputs();
+        outputs.clear();
+        std::vector<OutputOptions> settings = this->options.outputs;
+        if (settings.empty()) {
+            OutputOptions single;
+            single.width = this->options.width;
+            single.height = this->options.height;
+            single.format = this->options.format;
+            single.scaler = this->options.scaler;
+            single.jpeg = this->options.jpeg;
+            single.quality = this->options.quality;
+            settings.push_back(single);
+        }
+        for (size_t i = 0; i < settings.size(); i++) {
+            OutputProfile profile;
+            profile.settings = settings[i];
+            outputs.push_back(profile);
+        }
+        for (int i = (int)outputs.size(); i < MAX_OUTPUTS; i++) {
+            std::atomic_store(&pools[i], std::shared_ptr<FramePool>());
+        }
+        
+        if (open_input() < 0) {
+            return -1;
+        }
+        
+        packet = av_packet_alloc();
+        if (!packet) {
+            return -1;
+        }
+        
+        if (!this->options.record.path.empty()) {
+            recorder = new Remuxer(stats.recorder_dropped);
+            if (recorder->open(format_ctx, this->options.record) < 0) {
+                return -1;
+            }
+        }
+        
+        // Packet mode hands out compressed data as is: no decoder at all.
+        if (this->options.packets) {
+            return 0;
+        }
+        
+        if (open_decoder() < 0) {
+            return -1;
+        }
+        
+        frame = av_frame_alloc();
+        if (!frame) {
+            return -1;
+        }
+        
+        // Set up the output now when the geometry is known; otherwise it
+        // happens on the first frame, see convert().
+        if (!this->options.passthrough && codec_ctx->width > 0 && codec_ctx->height > 0 && codec_ctx->pix_fmt != AV_PIX_FMT_NONE) {
+            return setup_output(codec_ctx->width, codec_ctx->height, codec_ctx->pix_fmt);
+        }
+        return 0;
+    }
+    
+    int open_input() {
+        opened = av_gettime_relative();
+        first_frame = false;
+        
+        format_ctx = avformat_alloc_context();
+        format_ctx->interrupt_callback.callback = interrupt;
+        format_ctx->interrupt_callback.opaque = this;
+
+        char value[32];
+        AVDictionary* options = NULL;
+        av_dict_set(&options, "max_delay", "10000", 0);
+        av_dict_set(&options, "buffer_size", "1024000", 0);
+        av_dict_set(&options, "rtsp_transport", "tcp", 0);
+        snprintf(value, sizeof(value), "%d", this->options.analyzeduration);
+        av_dict_set(&options, "analyzeduration", value, 0);
+        if (this->options.probesize > 0) {
+            snprintf(value, sizeof(value), "%d", this->options.probesize);
+            av_dict_set(&options, "probesize", value, 0);
+        }
+        if (this->options.fpsprobesize >= 0) {
+            snprintf(value, sizeof(value), "%d", this->options.fpsprobesize);
+            av_dict_set(&options, "fpsprobesize", value, 0);
+        }
+        snprintf(value, sizeof(value), "%lld", (long long)this->options.timeout * 1000);
+        av_dict_set(&options, "stimeout", value, 0);
+        
+        // `stimeout` only bounds each socket read; a camera that trickles
+        // replies could keep the handshake and probing going far longer.
+        // The whole open gets `timeout` plus the time probing may take.
+        deadline = av_gettime_relative() + (int64_t)this->options.timeout * 1000 + this->options.analyzeduration;
+        int ret = open_format(&options);
+        deadline = 0;
+        av_dict_free(&options);
+        return ret;
+    }
+    
+    int open_format(AVDictionary** options) {
+        int ret = avformat_open_input(&format_ctx, url.c_str(), NULL, options);
+        if (ret != 0) {
+           printf("%s failed!\n", "avformat_open_input");
+           return -1;
+        }
+        
+        // On a reconnect, the last session's video parameters stand in for
+        // probing only if the SDP announces the same stream: same codec and
+        // parameter sets, and the same size where it gives one. Checked
+        // against the SDP's own parameters, before they are replaced.
+        reused = false;
+        if (cached_par && !this->options.packets) {
+            int index = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+            if (index >= 0 && SameStream(format_ctx->streams[index]->codecpar, cached_par)) {
+                reused = avcodec_parameters_copy(format_ctx->streams[index]->codecpar, cached_par) >= 0;
+            }
+        }
+        
+        // Without probing, codec parameters come from the SDP alone; the
+        // decoder learns the rest from the first keyframe.
+        if (this->options.probe && !reused && avformat_find_stream_info(format_ctx, NULL) < 0) {
+           printf("%s failed!\n", "avformat_find_stream_info");
+           return -1;
+        }
+        
+        if (this->options.verbose) {
+            av_dump_format(format_ctx, 0, NULL, 0);
+        }
+        
+        // Only helps inputs that can report EAGAIN. RTSP over TCP reads
+        // whole interleaved packets with blocking calls, so there a silent
+        // camera holds the thread until `timeout`.
+        if (this->options.nonblock) {
+            format_ctx->flags |= AVFMT_FLAG_NONBLOCK;
+        }
+        
+        if (this->options.packets) {
+            return 0;
+        }
+        
+        video_index = av_find_best_stream(format_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+        if(video_index < 0){
+           printf("%s failed!\n", "av_find_best_stream");
+           return -1;
+        }
+        return 0;
+    }
+    
+    int open_decoder() {
+        codec_ctx = avcodec_alloc_context3(NULL);
+        avcodec_parameters_to_context(codec_ctx, format_ctx->streams[video_index]->codecpar);
+
+        // Frame threading adds a frame of latency per thread, so the
+        // default is half the cores, at most 4: at most 3 frames of delay.
+        int threads = this->options.threads;
+        if (threads <= 0) {
+            threads = (int)std::thread::hardware_concurrency() / 2;
+            threads = threads < 1 ? 1 : threads > 4 ? 4 : threads;
+        }
+        codec_ctx->thread_count = threads;
+        codec_ctx->thread_type = this->options.thread_type;
+        codec_ctx->skip_frame = this->options.skip;
+
+        stats.codec_id = codec_ctx->codec_id;
+
+        codec = avcodec_find_decoder(codec_ctx->codec_id);
+        if(avcodec_open2(codec_ctx, codec, NULL)<0){
+           printf("%s failed!\n", "avcodec_open2");
+           return -1;
+        }
+        return 0;
+    }
+    
+    // Sizes every output profile, its pool and its scaler for a source
+    // geometry. Scalers come from the cache, so switching back to an
+    // earlier geometry reuses them.
+    int setup_output(int width, int height, AVPixelFormat pix_fmt) {
+        src_width = width;
+        src_height = height;
+        src_format = pix_fmt;
+        
+        for (size_t i = 0; i < outputs.size(); i++) {
+            OutputProfile& profile = outputs[i];
+            profile.width = profile.settings.width;
+            profile.height = profile.settings.height;
+            
+            // A missing dimension follows the source aspect ratio.
+            if (profile.width <= 0 && profile.height <= 0) {
+                profile.width = width;
+                profile.height = height;
+            } else if (profile.width <= 0) {
+                profile.width = (int)av_rescale(profile.height, width, height) & ~1;
+            } else if (profile.height <= 0) {
+                profile.height = (int)av_rescale(profile.width, height, width) & ~1;
+            }
+            
+            profile.buffer_size = av_image_get_buffer_size(profile.settings.format, profile.width, profile.height, 1);
+            if (profile.buffer_size < 0) {
+               printf("%s failed!\n", "av_image_get_buffer_size");
+               return -1;
+            }
+            
+            // JPEGs are sized by the encoder, not taken from a pool.
+            // Buffers still held by JS keep the previous pool alive.
+            std::shared_ptr<FramePool> current = std::atomic_load(&pools[i]);
+            if (profile.settings.jpeg) {
+                std::atomic_store(&pools[i], std::shared_ptr<FramePool>());
+            } else if (!current || current->size() != (size_t)profile.buffer_size) {
+                std::atomic_store(&pools[i], std::make_shared<FramePool>(this->options.pool_size, profile.buffer_size));
+            }
+            
+            if (profile.scaler) {
+                scaler_cache.put(profile.scaler);
+                profile.scaler = NULL;
+            }
+            av_frame_free(&profile.yuv);
+            
+            // Same geometry and layout as the decoder: a plain copy will
+            // do, and a JPEG is encoded straight from the decoded frame.
+            if (pix_fmt == profile.settings.format && width == profile.width && height == profile.height) {
+                continue;
+            }
+            
+            ScalerCache::Key key = { width, height, pix_fmt,
+                                     profile.width, profile.height, profile.settings.format,
+                                     profile.settings.scaler };
+            profile.scaler = scaler_cache.get(key);
+            if (!profile.scaler) {
+                return -1;
+            }
+            
+            if (profile.settings.jpeg) {
+                profile.yuv = av_frame_alloc();
+                if (!profile.yuv) {
+                    return -1;
+                }
+                profile.yuv->width = profile.width;
+                profile.yuv->height = profile.height;
+                profile.yuv->format = profile.settings.format;
+                if (av_frame_get_buffer(profile.yuv, 32) < 0) {
+                   printf("%s failed!\n", "av_frame_get_buffer");
+                   return -1;
+                }
+            }
+        }
+        return 0;
+    }
+    
+    // Gives the profiles' scalers back to the cache and frees their frames.
+    void release_outputs() {
+        for (size_t i = 0; i < outputs.size(); i++) {
+            if (outputs[i].scaler) {
+                scaler_cache.put(outputs[i].scaler);
+                outputs[i].scaler = NULL;
+            }
+            av_frame_free(&outputs[i].yuv);
+        }
+    }
+    
+    // Called when the input fails or ends with `reconnect` on. Each call
+    // makes at most one attempt, once the back-off delay has passed, and
+    // returns -4 meanwhile so callers can wait without blocking a thread
+    // for the whole delay. When the new session announces the same video
+    // stream, the lost session's parameters stand in for probing and the
+    // decoder, scaler and pool are kept; otherwise it is probed and the
+    // decoder rebuilt.
+    int reconnect() {
+        int64_t now = av_gettime_relative();
+        if (retry_at == 0) {
+            retries = 0;
+            retry_delay = this->options.reconnect.delay;
+            retry_at = now + (int64_t)retry_delay * 1000;
+            stats.reconnects++;
+            
+            // Kept until a session succeeds: failed attempts leave no
+            // input to compare against.
+            avcodec_parameters_free(&cached_par);
+            if (video_index >= 0 && format_ctx) {
+                cached_par = avcodec_parameters_alloc();
+                if (cached_par && avcodec_parameters_copy(cached_par, format_ctx->streams[video_index]->codecpar) < 0) {
+                    avcodec_parameters_free(&cached_par);
+                }
+            }
+            return -4;
+        }
+        if (now < retry_at) {
+            return -4;
+        }
+        
+        avformat_close_input(&format_ctx);
+        
+        if (open_input() < 0) {
+            avformat_close_input(&format_ctx);
+            
+            retries++;
+            if (this->options.reconnect.retries >= 0 && retries >= this->options.reconnect.retries) {
+                retry_at = 0;
+                avcodec_parameters_free(&cached_par);
+                return -2;
+            }
+            retry_delay = retry_delay * 2 < this->options.reconnect.max_delay ? retry_delay * 2 : this->options.reconnect.max_delay;
+            retry_at = av_gettime_relative() + (int64_t)retry_delay * 1000;
+            return -4;
+        }
+        retry_at = 0;
+        
+        if (recorder) {
+            recorder->discontinuity(format_ctx);
+        }
+        
+        flushed = false;
+        if (!this->options.packets) {
+            if (reused) {
+                avcodec_flush_buffers(codec_ctx);
+            } else {
+                avcodec_free_context(&codec_ctx);
+                if (open_decoder() < 0) {
+                    avcodec_parameters_free(&cached_par);
+                    return -2;
+                }
+            }
+        }
+        avcodec_parameters_free(&cached_par);
+        return -1;
+    }
+    
+    // Makes the next decoded frame current in `frame`. Returns -1 when the
+    // packet read produced no wanted frame, -3 once the decoder is fully
+    // drained and -4 when a non-blocking input has no data yet.
+    int read() {
+        if (retry_at != 0) {
+            return reconnect();
+        }
+        
+        int ret;
+        if (options.packets) {
+            av_packet_unref(packet);
+            ret = demux();
+        } else {
+            ret = decode();
+        }
+        
+        if ((ret == -2 || ret == -3) && options.reconnect.enabled && !aborted) {
+            return reconnect();
+        }
+        if (ret != 0) {
+            return ret;
+        }
+        
+        if (!first_frame) {
+            first_frame = true;
+            stats.time_to_first_frame = av_gettime_relative() - opened;
+        }
+        if (options.packets) {
+            return 0;
+        }
+        
+        observe();
+        if (!wanted()) {
+            stats.frames_dropped++;
+            return -1;
+        }
+        
+        // Still frames stop here, before any conversion or copy.
+        if (options.motion.enabled && !gate.check(frame, options.motion)) {
+            stats.frames_dropped++;
+            stats.frames_still++;
+            return -1;
+        }
+        return 0;
+    }
+    
+    // Stream time of the current frame in seconds, NAN when unknown.
+    double pts() const {
+        if (frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+            return NAN;
+        }
+        return frame->best_effort_timestamp * av_q2d(format_ctx->streams[video_index]->time_base);
+    }
+    
+    // Jitter is how far the packets' arrival spacing strays from the
+    // spacing of their timestamps.
+    void observe() {
+        stats.width = frame->width;
+        stats.height = frame->height;
+        
+        double now_pts = pts();
+        int64_t arrived = frame->reordered_opaque;
+        if (last_arrival > 0 && arrived > last_arrival && !std::isnan(now_pts) && !std::isnan(last_pts) && now_pts > last_pts) {
+            int64_t expected = (int64_t)((now_pts - last_pts) * 1000000);
+            int64_t actual = arrived - last_arrival;
+            stats.jitter.record(actual > expected ? actual - expected : expected - actual);
+        }
+        if (arrived > last_arrival) {
+            last_arrival = arrived;
+            last_pts = now_pts;
+        }
+    }
+    
+    int decode() {
+        if (next()) {
+            return 0;
+        }
+        
+        if (flushed) {
+            return -3;
+        }
+        
+        int ret = demux();
+        if (ret == -3) {
+            // Flush the frames still held for reordering or by other threads.
+            flushed = true;
+            avcodec_send_packet(codec_ctx, NULL);
+            drain();
+            return next() ? 0 : -3;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        
+        if(packet->stream_index != video_index) {
+            av_packet_unref(packet);
+            return -1;
+        }
+        
+        // The decoder would discard these anyway; don't even send them.
+        if (options.skip == AVDISCARD_NONKEY && !(packet->flags & AV_PKT_FLAG_KEY)) {
+            av_packet_unref(packet);
+            return -1;
+        }
+        
+        // Carried through reordering to the frame, for latency and jitter.
+        codec_ctx->reordered_opaque = demuxed;
+        
+        int64_t start = av_gettime_relative();
+        ret = avcodec_send_packet(codec_ctx, packet);
+        av_packet_unref(packet);
+        if (ret < 0) {
+            return -1;
+        }
+        
+        // A corrupt frame is skipped like a rejected packet; only running
+        // out of memory ends the stream.
+        if (drain() == AVERROR(ENOMEM)) {
+            return -2;
+        }
+        stats.decode.record(av_gettime_relative() - start);
+
+        return next() ? 0 : -1;
+    }
+    
+    // Reads the next packet of any stream into `packet` and hands a
+    // reference to the recorder, if any.
+    int demux() {
+        int64_t start = av_gettime_relative();
+        int ret = av_read_frame(format_ctx, packet);
+        if (ret == AVERROR(EAGAIN)) {
+            return -4;
+        }
+        if (ret == AVERROR_EOF) {
+            av_packet_unref(packet);
+            return -3;
+        }
+        if (ret < 0) {
+            av_packet_unref(packet);
+            printf("%s failed!\n", "av_read_frame");
+            return -2;
+        }
+        
+        demuxed = av_gettime_relative();
+        stats.demux.record(demuxed - start);
+        stats.packets++;
+        stats.bytes_in += packet->size;
+        
+        if (recorder) {
+            recorder->write(packet);
+        }
+        return 0;
+    }
+    
+    // Decimation: keeps every Nth frame, then at most max_fps frames per
+    // second of stream time (wall time when the stream has no timestamps).
+    // Dropped frames are never converted or handed to JS.
+    bool wanted() {
+        decoded++;
+        if (options.every > 1 && (decoded - 1) % options.every != 0) {
+            return false;
+        }
+        
+        if (options.max_fps > 0) {
+            double interval = 1.0 / options.max_fps;
+            double now = pts();
+            if (std::isnan(now)) {
+                now = av_gettime_relative() / 1000000.0;
+            }
+            
+            // Restart the schedule on the first frame and on discontinuities.
+            if (next_time == AV_NOPTS_VALUE || now < next_time - 2 * interval - 1) {
+                next_time = now + interval;
+                return true;
+            }
+            if (now < next_time) {
+                return false;
+            }
+            next_time += interval;
+            if (next_time <= now) {
+                next_time = now + interval;
+            }
+        }
+        
+        return true;
+    }
+    
+    // Queues every frame the decoder has ready.
+    int drain() {
+        for (;;) {
+            AVFrame* ready = NULL;
+            if (spare_frames.empty()) {
+                ready = av_frame_alloc();
+                if (!ready) {
+                    return AVERROR(ENOMEM);
+                }
+            } else {
+                ready = spare_frames.back();
+                spare_frames.pop_back();
+            }
+            
+            int ret = avcodec_receive_frame(codec_ctx, ready);
+            if (ret < 0) {
+                spare_frames.push_back(ready);
+                return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+            }
+            frames.push_back(ready);
+            frame_times.push_back(av_gettime_relative());
+            stats.frames_decoded++;
+        }
+    }
+    
+    bool next() {
+        if (frames.empty()) {
+            return false;
+        }
+        
+        AVFrame* ready = frames.front();
+        frames.pop_front();
+        decoded_at = frame_times.front();
+        frame_times.pop_front();
+        av_frame_unref(frame);
+        av_frame_move_ref(frame, ready);
+        spare_frames.push_back(ready);
+        return true;
+    }
+    
+    // Follows the current frame's geometry, which may differ from what the
+    // stream announced or change mid-stream. Call before taking a buffer.
+    int prepare() {
+        if (frame->width != src_width || frame->height != src_height || frame->format != src_format) {
+            return setup_output(frame->width, frame->height, (AVPixelFormat)frame->format);
+        }
+        return 0;
+    }
+    
+    // Scales the last decoded frame into dst, which holds the profile's
+    // buffer_size bytes. Profiles may convert concurrently: each has its
+    // own scaler and only reads the frame.
+    int convert(size_t index, uint8_t* dst) {
+        int64_t start = av_gettime_relative();
+        const OutputProfile& profile = outputs[index];
+        
+        if (!profile.scaler) {
+            if (av_image_copy_to_buffer(dst, profile.buffer_size,
+                                        (const uint8_t* const*)frame->data, frame->linesize,
+                                        profile.settings.format, profile.width, profile.height, 1) < 0) {
+                return -1;
+            }
+            stats.convert.record(av_gettime_relative() - start);
+            stats.bytes_out += profile.buffer_size;
+            stats.bytes_copied += profile.buffer_size;
+            return 0;
+        }
+
+        uint8_t* data[4];
+        int linesize[4];
+        av_image_fill_arrays(data, linesize, dst, profile.settings.format, profile.width, profile.height, 1);
+        
+        if (sws_scale(profile.scaler,
+                        (const unsigned char* const*)frame->data, 
+                        frame->linesize, 
+                        0, 
+                        frame->height,
+                        data, 
+                        linesize) < 0){
+            return -1;
+        }
+        
+        stats.convert.record(av_gettime_relative() - start);
+        stats.bytes_out += profile.buffer_size;
+        return 0;
+    }
+    
+    // Scales the last decoded frame into the JPEG profile's YUV frame and
+    // returns the frame to encode, which is the decoded frame itself when
+    // no scaling is needed.
+    const AVFrame* scale(size_t index) {
+        const OutputProfile& profile = outputs[index];
+        if (!profile.scaler) {
+            return frame;
+        }
+        if (av_frame_make_writable(profile.yuv) < 0 ||
+            sws_scale(profile.scaler,
+                      (const unsigned char* const*)frame->data,
+                      frame->linesize,
+                      0,
+                      frame->height,
+                      profile.yuv->data,
+                      profile.yuv->linesize) < 0) {
+            return NULL;
+        }
+        return profile.yuv;
+    }
+    
+    // Sums the pools of all profiles.
+    FramePool::Stats pool_stats() {
+        FramePool::Stats total = { 0, 0, 0, 0 };
+        for (int i = 0; i < MAX_OUTPUTS; i++) {
+            std::shared_ptr<FramePool> pool = std::atomic_load(&pools[i]);
+            if (pool) {
+                FramePool::Stats stats = pool->stats();
+                total.slots += stats.slots;
+                total.free += stats.free;
+                total.acquired += stats.acquired;
+                total.exhausted += stats.exhausted;
+            }
+        }
+        return total;
+    }
+    
+    // Explicit release from JS; the buffer may come from any profile.
+    bool release(const void* data) {
+        for (int i = 0; i < MAX_OUTPUTS; i++) {
+            std::shared_ptr<FramePool> pool = std::atomic_load(&pools[i]);
+            if (pool && pool->release(data)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void close() {
+        if (recorder) {
+            delete recorder;
+            recorder = NULL;
+        }
+
+        for (size_t i = 0; i < frames.size(); i++) {
+            av_frame_free(&frames[i]);
+        }
+        frames.clear();
+        frame_times.clear();
+        flushed = false;
+        video_index = -1;
+        retry_at = 0;
+        avcodec_parameters_free(&cached_par);
+        src_width = 0;
+        src_height = 0;
+        src_format = AV_PIX_FMT_NONE;
+        decoded = 0;
+        next_time = AV_NOPTS_VALUE;
+        demuxed = 0;
+        last_arrival = 0;
+        last_pts = NAN;
+
+        for (size_t i = 0; i < spare_frames.size(); i++) {
+            av_frame_free(&spare_frames[i]);
+        }
+        spare_frames.clear();
+
+        if (frame) { 
+            av_frame_free(&frame); 
+            frame = NULL;
+        }
+
+        if (format_ctx) { 
+            avformat_close_input(&format_ctx); 
+            format_ctx = NULL;
+        }
+
+        if (codec_ctx) { 
+            avcodec_free_context(&codec_ctx); 
+            codec_ctx = NULL;
+        }
+
+        release_outputs();
+        scaler_cache.clear();
+
+        if (packet) {
+            av_packet_free(&packet);
+            packet = NULL;
+        }
+
+    }
+    
+    // Makes any blocking libavformat call return as soon as possible.
+    void abort() { aborted = true; }
+    
+    ~AVContext(){ close(); }
+    
+    // Whether sdp, as announced before any probing, describes the stream
+    // last decoded with cached. Without parameter sets nothing is known.
+    static bool SameStream(const AVCodecParameters* sdp, const AVCodecParameters* cached) {
+        if (sdp->codec_id != cached->codec_id) {
+            return false;
+        }
+        if ((sdp->width && sdp->width != cached->width) || (sdp->height && sdp->height != cached->height)) {
+            return false;
+        }
+        return sdp->extradata_size > 0 && sdp->extradata_size == cached->extradata_size &&
+            memcmp(sdp->extradata, cached->extradata, sdp->extradata_size) == 0;
+    }
+    
+    static int interrupt(void* opaque) {
+        AVContext* ctx = static_cast<AVContext*>(opaque);
+        int64_t deadline = ctx->deadline;
+        if (deadline && av_gettime_relative() > deadline) {
+            return 1;
+        }
+        return ctx->aborted ? 1 : 0;
+    }
+    
+public:
+    std::atomic<bool> aborted{false};
+    std::atomic<int64_t> deadline{0};
+    std::string url;
+    StreamOptions options;
+    StreamStats stats;
+    FrameTrace trace;
+    AVFormatContext *format_ctx = NULL;
+    int video_index = -1;
+    AVCodecContext *codec_ctx = NULL;
+    AVCodec *codec = NULL;
+    AVFrame  *frame = NULL;
+    std::deque<AVFrame*> frames;
+    std::deque<int64_t> frame_times;
+    int64_t decoded_at = 0;
+    std::vector<AVFrame*> spare_frames;
+    bool flushed = false;
+    int64_t decoded = 0;
+    double next_time = AV_NOPTS_VALUE;
+    int64_t demuxed = 0;
+    int64_t last_arrival = 0;
+    double last_pts = NAN;
+    AVPacket *packet = NULL;
+    int64_t opened = 0;
+    bool first_frame = false;
+    int64_t retry_at = 0;
+    int retries = 0;
+    int retry_delay = 0;
+    AVCodecParameters* cached_par = NULL;
+    bool reused = false;
+    int src_width = 0;
+    int src_height = 0;
+    int src_format = AV_PIX_FMT_NONE;
+    std::vector<OutputProfile> outputs;
+    std::shared_ptr<FramePool> pools[MAX_OUTPUTS];
+    ScalerCache scaler_cache;
+    MotionGate gate;
+    std::shared_ptr<FrameRing> ring;
+    Remuxer *recorder = NULL;
+};
+
+// Runs tasks one after another on a dedicated thread, so that a stream's
+// blocking demux/decode calls never touch the Node event loop.
+class Worker {
+public:
+    typedef std::function<void()> Task;
+    
+    Worker() : _thread(&Worker::run, this) {}
+    
+    ~Worker(){ stop(); }
+    
+    void post(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tasks.push_back(std::move(task));
+        }
+        _cond.notify_one();
+    }
+    
+    // Runs the tasks already posted, then joins the thread.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+        }
+        _cond.notify_one();
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
+    
+private:
+    void run() {
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cond.wait(lock, [this]{ return _stopped || !_tasks.empty(); });
+                if (_tasks.empty()) {
+                    return;
+                }
+                task = std::move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task();
+        }
+    }
+    
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::deque<Task> _tasks;
+    bool _stopped = false;
+    std::thread _thread;
+};
+
+// Fixed-size pool shared by many streams. Each thread has its own task
+// queue; tasks posted from a pool thread stay on that thread, and a thread
+// that runs dry steals from the back of the others' queues.
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+    typedef std::chrono::steady_clock Clock;
+    
+    explicit ThreadPool(int count) {
+        for (int i = 0; i < count; i++) {
+            _queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        }
+        for (int i = 0; i < count; i++) {
+            _threads.push_back(std::thread(&ThreadPool::run, this, (size_t)i));
+        }
+    }
+    
+    ~ThreadPool(){ stop(); }
+    
+    void post(Task task) {
+        size_t index = current() == this ? current_index() : _next++ % _queues.size();
+        {
+            std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+            _queues[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queued++;
+        }
+        _cond.notify_one();
+    }
+    
+    // Runs task once `ms` milliseconds have passed.
+    void post_after(Task task, int ms) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _timers.insert(std::make_pair(Clock::now() + std::chrono::milliseconds(ms), std::move(task)));
+        }
+        _cond.notify_one();
+    }
+    
+    // Drops pending timers, runs the queued tasks and joins the threads.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped = true;
+            _timers.clear();
+        }
+        _cond.notify_all();
+        for (size_t i = 0; i < _threads.size(); i++) {
+            if (_threads[i].joinable()) {
+                _threads[i].join();
+            }
+        }
+    }
+    
+    size_t size() const { return _threads.size(); }
+    
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    
+    static ThreadPool*& current() {
+        static thread_local ThreadPool* pool = NULL;
+        return pool;
+    }
+    
+    static size_t& current_index() {
+        static thread_local size_t index = 0;
+        return index;
+    }
+    
+    bool pop(size_t index, Task& task) {
+        {
+            Queue& own = *_queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        
+        for (size_t i = 1; i < _queues.size(); i++) {
+            Queue& other = *_queues[(index + i) % _queues.size()];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty()) {
+                task = std::move(other.tasks.back());
+                other.tasks.pop_back();
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    void run(size_t index) {
+        current() = this;
+        current_index() = index;
+        
+        for (;;) {
+            Task task;
+            if (pop(index, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _queued--;
+                }
+                task();
+                continue;
+            }
+            
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_queued > 0) {
+                continue;
+            }
+            
+            if (!_timers.empty() && _timers.begin()->first <= Clock::now()) {
+                task = std::move(_timers.begin()->second);
+                _timers.erase(_timers.begin());
+                lock.unlock();
+                task();
+                continue;
+            }
+            
+            if (_stopped) {
+                return;
+            }
+            
+            if (_timers.empty()) {
+                _cond.wait(lock);
+            } else {
+                _cond.wait_until(lock, _timers.begin()->first);
+            }
+        }
+    }
+    
+    std::vector<std::unique_ptr<Queue> > _queues;
+    std::vector<std::thread> _threads;
+    std::atomic<size_t> _next{0};
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    size_t _queued = 0;
+    std::multimap<Clock::time_point, Task> _timers;
+    bool _stopped = false;
+};
+
+// The result of one decoded frame, as produced on a worker thread: either
+// a pool buffer holding the converted image, one such output per entry of
+// the `outputs` option, or a reference to the decoder's own frame in
+// passthrough mode.
+struct FrameOutput {
+    FrameLease* lease = NULL;
+    std::vector<FrameOutput*> profiles;
+    AVFrame* frame = NULL;
+    AVPacket* packet = NULL;
+    AVPacket* jpeg = NULL;
+    int width = 0;
+    int height = 0;
+    int format = AV_PIX_FMT_NONE;
+    double pts = NAN;
+    int64_t received = 0;
+    int64_t decoded = 0;
+    double motion = NAN;
+    bool scene = false;
+    int activity_columns = 0;
+    std::vector<uint8_t> activity;
+    int32_t seq = 0;
+    int slot = -1;
+    
+    FrameOutput(){}
+    FrameOutput(const FrameOutput&) = delete;
+    FrameOutput& operator=(const FrameOutput&) = delete;
+    
+    void swap(FrameOutput& other) {
+        std::swap(lease, other.lease);
+        std::swap(profiles, other.profiles);
+        std::swap(frame, other.frame);
+        std::swap(packet, other.packet);
+        std::swap(jpeg, other.jpeg);
+        std::swap(width, other.width);
+        std::swap(height, other.height);
+        std::swap(format, other.format);
+        std::swap(pts, other.pts);
+        std::swap(received, other.received);
+        std::swap(decoded, other.decoded);
+        std::swap(motion, other.motion);
+        std::swap(scene, other.scene);
+        std::swap(activity_columns, other.activity_columns);
+        std::swap(activity, other.activity);
+        std::swap(seq, other.seq);
+        std::swap(slot, other.slot);
+    }
+    
+    ~FrameOutput(){
+        if (lease) {
+            lease->pool->release(lease);
+            delete lease;
+        }
+        for (size_t i = 0; i < profiles.size(); i++) {
+            delete profiles[i];
+        }
+        if (frame) {
+            av_frame_free(&frame);
+        }
+        if (packet) {
+            av_packet_free(&packet);
+        }
+        if (jpeg) {
+            av_packet_free(&jpeg);
+        }
+    }
+};
+
+// What open() resolves with: one entry per input stream.
+struct StreamInfo {
+    int index;
+    std::string type;
+    std::string codec;
+    int width;
+    int height;
+    AVRational time_base;
+    std::vector<uint8_t> extradata;
+};
+
+static void Describe(AVFormatContext* format_ctx, std::vector<StreamInfo>* streams) {
+    for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
+        AVStream* stream = format_ctx->streams[i];
+        AVCodecParameters* codecpar = stream->codecpar;
+        const char* type = av_get_media_type_string(codecpar->codec_type);
+        
+        StreamInfo info;
+        info.index = (int)i;
+        info.type = type ? type : "unknown";
+        info.codec = avcodec_get_name(codecpar->codec_id);
+        info.width = codecpar->width;
+        info.height = codecpar->height;
+        info.time_base = stream->time_base;
+        info.extradata.assign(codecpar->extradata, codecpar->extradata + codecpar->extradata_size);
+        streams->push_back(info);
+    }
+}
+
+// Encodes JPEG snapshots for every stream with libavcodec's MJPEG
+// encoder. Encoder contexts are kept per size and format and reused, and
+// the encoding runs on a small pool shared by all streams, which also caps
+// how many encodes run at once.
+class JpegEncoder {
+public:
+    static const size_t MAX_IDLE = 16;
+    
+    static JpegEncoder& shared() {
+        static JpegEncoder encoder([]() {
+            int threads = (int)std::thread::hardware_concurrency() / 2;
+            return threads < 1 ? 1 : threads > 4 ? 4 : threads;
+        }());
+        return encoder;
+    }
+    
+    explicit JpegEncoder(int threads) : _pool(threads) {}
+    
+    ~JpegEncoder(){
+        _pool.stop();
+        for (size_t i = 0; i < _idle.size(); i++) {
+            avcodec_free_context(&_idle[i]);
+        }
+    }
+    
+    // Encodes frame at quality 1-100 and waits for the result. Returns
+    // NULL on failure.
+    AVPacket* encode(const AVFrame* frame, int quality) {
+        AVPacket* packet = NULL;
+        bool done = false;
+        std::mutex mutex;
+        std::condition_variable cond;
+        
+        _pool.post([this, frame, quality, &packet, &done, &mutex, &cond]() {
+            AVPacket* result = run(frame, quality);
+            std::lock_guard<std::mutex> lock(mutex);
+            packet = result;
+            done = true;
+            cond.notify_one();
+        });
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&done]{ return done; });
+        return packet;
+    }
+    
+private:
+    AVPacket* run(const AVFrame* frame, int quality) {
+        AVCodecContext* codec_ctx = acquire(frame->width, frame->height, (AVPixelFormat)frame->format);
+        if (!codec_ctx) {
+            return NULL;
+        }
+        
+        // MJPEG quantizer scale: 2 is the finest, 31 the coarsest.
+        int qscale = 2 + (100 - quality) * 29 / 99;
+        
+        AVFrame* input = av_frame_clone(frame);
+        AVPacket* packet = av_packet_alloc();
+        if (!input || !packet) {
+            av_frame_free(&input);
+            av_packet_free(&packet);
+            release(codec_ctx);
+            return NULL;
+        }
+        input->quality = qscale * FF_QP2LAMBDA;
+        input->pict_type = AV_PICTURE_TYPE_NONE;
+        input->pts = AV_NOPTS_VALUE;
+        
+        int ret = avcodec_send_frame(codec_ctx, input);
+        if (ret >= 0) {
+            ret = avcodec_receive_packet(codec_ctx, packet);
+        }
+        av_frame_free(&input);
+        
+        // A failed encoder may be left mid-frame: do not reuse it.
+        if (ret < 0) {
+            printf("%s failed!\n", "avcodec_encode_jpeg");
+            avcodec_free_context(&codec_ctx);
+            av_packet_free(&packet);
+            return NULL;
+        }
+        
+        release(codec_ctx);
+        return packet;
+    }
+    
+    AVCodecContext* acquire(int width, int height, AVPixelFormat pix_fmt) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (size_t i = 0; i < _idle.size(); i++) {
+                AVCodecContext* codec_ctx = _idle[i];
+                if (codec_ctx->width == width && codec_ctx->height == height && codec_ctx->pix_fmt == pix_fmt) {
+                    _idle.erase(_idle.begin() + i);
+                    return codec_ctx;
+                }
+            }
+        }
+        
+        AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+        if (!codec) {
+            printf("%s failed!\n", "avcodec_find_encoder");
+            return NULL;
+        }
+        
+        AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
+        if (!codec_ctx) {
+            return NULL;
+        }
+        codec_ctx->width = width;
+        codec_ctx->height = height;
+        codec_ctx->pix_fmt = pix_fmt;
+        codec_ctx->time_base = AVRational{ 1, 25 };
+        codec_ctx->flags |= AV_CODEC_FLAG_QSCALE;
+        codec_ctx->thread_count = 1;
+        
+        if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
+            printf("%s failed!\n", "avcodec_open2");
+            avcodec_free_context(&codec_ctx);
+            return NULL;
+        }
+        return codec_ctx;
+    }
+    
+    // Keeps the context for the next frame of the same size; beyond
+    // MAX_IDLE the oldest idle one goes.
+    void release(AVCodecContext* codec_ctx) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _idle.push_back(codec_ctx);
+        if (_idle.size() > MAX_IDLE) {
+            avcodec_free_context(&_idle.front());
+            _idle.erase(_idle.begin());
+        }
+    }
+    
+    ThreadPool _pool;
+    std::mutex _mutex;
+    std::vector<AVCodecContext*> _idle;
+};
+
+// Converts the current frame for one output profile into a pool buffer,
+// or encodes it for a JPEG profile.
+static int ProduceProfile(AVContext* ctx, size_t index, FrameOutput* output) {
+    const OutputProfile& profile = ctx->outputs[index];
+    output->width = profile.width;
+    output->height = profile.height;
+    output->format = profile.settings.format;
+    
+    if (profile.settings.jpeg) {
+        int64_t start = av_gettime_relative();
+        const AVFrame* source = ctx->scale(index);
+        output->jpeg = source ? JpegEncoder::shared().encode(source, profile.settings.quality) : NULL;
+        if (!output->jpeg) {
+            return -1;
+        }
+        ctx->stats.convert.record(av_gettime_relative() - start);
+        ctx->stats.bytes_out += output->jpeg->size;
+        return 0;
+    }
+    
+    output->lease = ctx->pools[index]->acquire();
+    if (!output->lease || ctx->convert(index, output->lease->data) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Shared by every stream for converting output profiles in parallel. Its
+// threads never wait on one another, so Produce can block on them from
+// any worker or pool thread.
+static ThreadPool& ScalePool() {
+    static ThreadPool pool([]() {
+        int threads = (int)std::thread::hardware_concurrency();
+        return threads < 1 ? 1 : threads > 8 ? 8 : threads;
+    }());
+    return pool;
+}
+
+// Fills output from the context's current frame, or packet in packet mode.
+static int Produce(AVContext* ctx, FrameOutput* output) {
+    if (ctx->options.packets) {
+        output->packet = av_packet_alloc();
+        if (!output->packet) {
+            return -2;
+        }
+        av_packet_move_ref(output->packet, ctx->packet);
+        output->received = ctx->demuxed;
+        output->decoded = ctx->demuxed;
+        return 0;
+    }
+    
+    output->pts = ctx->pts();
+    output->received = ctx->frame->reordered_opaque;
+    if (ctx->options.motion.enabled && !std::isnan(ctx->gate.score)) {
+        output->motion = ctx->gate.score;
+        output->scene = ctx->gate.scene;
+        output->activity_columns = ctx->gate.columns;
+        output->activity = ctx->gate.activity;
+    }
+    
+    if (ctx->options.passthrough) {
+        output->frame = av_frame_clone(ctx->frame);
+        output->decoded = ctx->decoded_at;
+        return output->frame ? 0 : -2;
+    }
+    
+    if (ctx->prepare() < 0) {
+        return -2;
+    }
+    
+    // With a ring, the image is converted straight into shared memory.
+    // setRing() and open() only allow a single raw output with one. An
+    // image larger than a slot is -6, so JS can tell it from a failed read.
+    std::shared_ptr<FrameRing> ring = std::atomic_load(&ctx->ring);
+    if (ring) {
+        const OutputProfile& profile = ctx->outputs[0];
+        uint8_t* dst = ring->begin(profile.buffer_size, &output->seq, &output->slot);
+        if (!dst) {
+            return -6;
+        }
+        if (ctx->convert(0, dst) < 0) {
+            return -2;
+        }
+        ring->commit(output->slot, output->seq, profile.width, profile.height,
+                     profile.settings.format, profile.buffer_size, output->pts);
+        output->width = profile.width;
+        output->height = profile.height;
+        output->format = profile.settings.format;
+        output->decoded = ctx->decoded_at;
+        return 0;
+    }
+    
+    if (ctx->options.outputs.empty()) {
+        if (ProduceProfile(ctx, 0, output) < 0) {
+            return -2;
+        }
+        output->decoded = ctx->decoded_at;
+        return 0;
+    }
+    
+    // One decode, every profile: the first is converted here while the
+    // others run on the shared scaling pool, and all are delivered
+    // together.
+    size_t count = ctx->outputs.size();
+    for (size_t i = 0; i < count; i++) {
+        output->profiles.push_back(new FrameOutput());
+    }
+    
+    std::vector<int> results(count, 0);
+    std::mutex mutex;
+    std::condition_variable cond;
+    size_t remaining = count - 1;
+    
+    for (size_t i = 1; i < count; i++) {
+        ScalePool().post([ctx, i, output, &results, &mutex, &cond, &remaining]() {
+            int ret = ProduceProfile(ctx, i, output->profiles[i]);
+            std::lock_guard<std::mutex> lock(mutex);
+            results[i] = ret;
+            remaining--;
+            cond.notify_one();
+        });
+    }
+    results[0] = ProduceProfile(ctx, 0, output->profiles[0]);
+    
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [&remaining]{ return remaining == 0; });
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] < 0) {
+            return -2;
+        }
+        output->profiles[i]->pts = output->pts;
+    }
+    output->decoded = ctx->decoded_at;
+    return 0;
+}
+
+static void SetNumber(napi_env env, napi_value object, const char* name, double number) {
+    napi_value value;
+    if (napi_create_double(env, number, &value) == napi_ok) {
+        napi_set_named_property(env, object, name, value);
+    }
+}
+
+static void SetString(napi_env env, napi_value object, const char* name, const char* string) {
+    napi_value value;
+    if (napi_create_string_utf8(env, string ? string : "", NAPI_AUTO_LENGTH, &value) == napi_ok) {
+        napi_set_named_property(env, object, name, value);
+    }
+}
+
+static void ReleaseFrame(napi_env env, void* data, void* hint) {
+    AVFrame* frame = static_cast<AVFrame*>(hint);
+    av_frame_free(&frame);
+}
+
+static void ReleaseLease(napi_env env, void* data, void* hint) {
+    FrameLease* lease = static_cast<FrameLease*>(hint);
+    lease->pool->release(lease);
+    delete lease;
+}
+
+// Wraps each plane of a decoded frame without copying; every plane
+// Buffer holds its own reference to the frame's data.
+static napi_value Planes(napi_env env, AVFrame* frame) {
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+    if (!desc) {
+        return NULL;
+    }
+
+    napi_value result, planes, linesize;
+    if (napi_create_object(env, &result) != napi_ok ||
+        napi_create_array(env, &planes) != napi_ok ||
+        napi_create_array(env, &linesize) != napi_ok) {
+        return NULL;
+    }
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->data[i]; i++) {
+        int height = frame->height;
+        if ((i == 1 || i == 2) && !(desc->flags & AV_PIX_FMT_FLAG_PAL)) {
+            height = AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h);
+        }
+
+        AVFrame* ref = av_frame_clone(frame);
+        if (!ref) {
+            return NULL;
+        }
+
+        napi_value plane, stride;
+        if (napi_create_external_buffer(env,
+                                        (size_t)frame->linesize[i] * height,
+                                        frame->data[i],
+                                        ReleaseFrame,
+                                        ref,
+                                        &plane) != napi_ok) {
+            av_frame_free(&ref);
+            return NULL;
+        }
+
+        napi_create_int32(env, frame->linesize[i], &stride);
+        napi_set_element(env, planes, i, plane);
+        napi_set_element(env, linesize, i, stride);
+    }
+
+    SetNumber(env, result, "width", frame->width);
+    SetNumber(env, result, "height", frame->height);
+    SetString(env, result, "format", desc->name);
+    napi_set_named_property(env, result, "planes", planes);
+    napi_set_named_property(env, result, "linesize", linesize);
+    return result;
+}
+
+// Reads an optional integer property; leaves *out untouched when absent.
+static bool GetInt(napi_env env, napi_value object, const char* name, int* out) {
+    bool has = false;
+    if (napi_has_named_property(env, object, name, &has) != napi_ok || !has) {
+        return true;
+    }
+
+    napi_value value;
+    if (napi_get_named_property(env, object, name, &value) != napi_ok) {
+        return false;
+    }
+
+    napi_valuetype type;
+    if (napi_typeof(env, value, &type) != napi_ok) {
+        return false;
+    }
+    if (type == napi_undefined) {
+        return true;
+    }
+
+    return napi_get_value_int32(env, value, out) == napi_ok;
+}
+
+// Reads an optional number property; leaves *out untouched when absent.
+static bool GetDouble(napi_env env, napi_value object, const char* name, double* out) {
+    bool has = false;
+    if (napi_has_named_property(env, object, name, &has) != napi_ok || !has) {
+        return true;
+    }
+
+    napi_value value;
+    if (napi_get_named_property(env, object, name, &value) != napi_ok) {
+        return false;
+    }
+
+    napi_valuetype type;
+    if (napi_typeof(env, value, &type) != napi_ok) {
+        return false;
+    }
+    if (type == napi_undefined) {
+        return true;
+    }
+
+    return napi_get_value_double(env, value, out) == napi_ok;
+}
+
+// Reads an optional boolean property; leaves *out untouched when absent.
+static bool GetBool(napi_env env, napi_value object, const char* name, bool* out) {
+    bool has = false;
+    if (napi_has_named_property(env, object, name, &has) != napi_ok || !has) {
+        return true;
+    }
+
+    napi_value value;
+    if (napi_get_named_property(env, object, name, &value) != napi_ok) {
+        return false;
+    }
+
+    napi_valuetype type;
+    if (napi_typeof(env, value, &type) != napi_ok) {
+        return false;
+    }
+    if (type == napi_undefined) {
+        return true;
+    }
+
+    return napi_get_value_bool(env, value, out) == napi_ok;
+}
+
+// Reads an optional string property into out, truncating to size - 1.
+static bool GetString(napi_env env, napi_value object, const char* name, char* out, size_t size) {
+    bool has = false;
+    if (napi_has_named_property(env, object, name, &has) != napi_ok || !has) {
+        return true;
+    }
+
+    napi_value value;
+    if (napi_get_named_property(env, object, name, &value) != napi_ok) {
+        return false;
+    }
+
+    napi_valuetype type;
+    if (napi_typeof(env, value, &type) != napi_ok) {
+        return false;
+    }
+    if (type == napi_undefined) {
+        return true;
+    }
+
+    size_t len = 0;
+    return napi_get_value_string_utf8(env, value, out, size, &len) == napi_ok;
+}
+
+template <typename T, size_t N>
+static const T* FindName(const T (&table)[N], const char* name) {
+    for (size_t i = 0; i < N; i++) {
+        if (strcmp(table[i].name, name) == 0) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
+
+static bool GetOptions(napi_env env, napi_value object, StreamOptions* options) {
+    napi_valuetype type;
+    if (napi_typeof(env, object, &type) != napi_ok) {
+        return false;
+    }
+    if (type == napi_undefined || type == napi_null) {
+        return true;
+    }
+    if (type != napi_object) {
+        return false;
+    }
+
+    if (!GetInt(env, object, "poolSize", &options->pool_size) || options->pool_size < 0) {
+        return false;
+    }
+
+    if (!GetInt(env, object, "width", &options->width) ||
+        !GetInt(env, object, "height", &options->height)) {
+        return false;
+    }
+
+    char name[32] = {0};
+    if (!GetString(env, object, "format", name, sizeof(name))) {
+        return false;
+    }
+    if (strcmp(name, "jpeg") == 0) {
+        options->jpeg = true;
+        options->format = AV_PIX_FMT_YUVJ420P;
+    } else if (name[0]) {
+        const PixelFormatName* pixel_format = FindName(pixel_formats, name);
+        if (!pixel_format) {
+            return false;
+        }
+        options->format = pixel_format->format;
+        options->passthrough = pixel_format->format == AV_PIX_FMT_NONE;
+    }
+
+    if (!GetInt(env, object, "quality", &options->quality) || options->quality < 1 || options->quality > 100) {
+        return false;
+    }
+
+    if (!GetInt(env, object, "threads", &options->threads) ||
+        !GetInt(env, object, "timeout", &options->timeout) || options->timeout < 1) {
+        return false;
+    }
+
+    name[0] = 0;
+    if (!GetString(env, object, "threadType", name, sizeof(name))) {
+        return false;
+    }
+    if (name[0]) {
+        const ThreadTypeName* thread_type = FindName(thread_types, name);
+        if (!thread_type) {
+            return false;
+        }
+        options->thread_type = thread_type->type;
+    }
+
+    name[0] = 0;
+    if (!GetString(env, object, "skip", name, sizeof(name))) {
+        return false;
+    }
+    if (name[0]) {
+        const DiscardName* discard = FindName(discards, name);
+        if (!discard) {
+            return false;
+        }
+        options->skip = discard->discard;
+    }
+
+    if (!GetInt(env, object, "every", &options->every) || options->every < 1 ||
+        !GetDouble(env, object, "maxFps", &options->max_fps) || options->max_fps < 0) {
+        return false;
+    }
+
+    if (!GetBool(env, object, "packets", &options->packets)) {
+        return false;
+    }
+
+    bool has = false;
+    if (napi_has_named_property(env, object, "record", &has) != napi_ok) {
+        return false;
+    }
+    if (has) {
+        napi_value record;
+        if (napi_get_named_property(env, object, "record", &record) != napi_ok ||
+            napi_typeof(env, record, &type) != napi_ok || type != napi_object) {
+            return false;
+        }
+
+        char path[1024] = {0};
+        name[0] = 0;
+        if (!GetString(env, record, "path", path, sizeof(path)) || !path[0] ||
+            !GetString(env, record, "format", name, sizeof(name)) ||
+            !GetInt(env, record, "segment", &options->record.segment) || options->record.segment < 1 ||
+            !GetBool(env, record, "strftime", &options->record.strftime)) {
+            return false;
+        }
+        options->record.path = path;
+        if (name[0]) {
+            options->record.format = name;
+        }
+    }
+
+    if (!GetInt(env, object, "trace", &options->trace) || options->trace < 0) {
+        return false;
+    }
+
+    if (!GetBool(env, object, "probe", &options->probe) ||
+        !GetInt(env, object, "probesize", &options->probesize) ||
+        !GetInt(env, object, "analyzeduration", &options->analyzeduration) ||
+        !GetInt(env, object, "fpsprobesize", &options->fpsprobesize) ||
+        !GetBool(env, object, "verbose", &options->verbose)) {
+        return false;
+    }
+
+    // reconnect: true, or { retries, delay, maxDelay }.
+    if (napi_has_named_property(env, object, "reconnect", &has) != napi_ok) {
+        return false;
+    }
+    if (has) {
+        napi_value reconnect;
+        if (napi_get_named_property(env, object, "reconnect", &reconnect) != napi_ok ||
+            napi_typeof(env, reconnect, &type) != napi_ok) {
+            return false;
+        }
+        if (type == napi_boolean) {
+            napi_get_value_bool(env, reconnect, &options->reconnect.enabled);
+        } else if (type == napi_object) {
+            options->reconnect.enabled = true;
+            if (!GetInt(env, reconnect, "retries", &options->reconnect.retries) ||
+                !GetInt(env, reconnect, "delay", &options->reconnect.delay) || options->reconnect.delay < 0 ||
+                !GetInt(env, reconnect, "maxDelay", &options->reconnect.max_delay) || options->reconnect.max_delay < 0) {
+                return false;
+            }
+        } else if (type != napi_undefined) {
+            return false;
+        }
+    }
+
+    if (!GetInt(env, object, "queueSize", &options->queue_size) || options->queue_size < 0 ||
+        !GetInt(env, object, "maxLatency", &options->max_latency) || options->max_latency < 0) {
+        return false;
+    }
+
+    name[0] = 0;
+    if (!GetString(env, object, "dropPolicy", name, sizeof(name))) {
+        return false;
+    }
+    if (name[0]) {
+        const DropPolicyName* drop_policy = FindName(drop_policies, name);
+        if (!drop_policy) {
+            return false;
+        }
+        options->drop_policy = drop_policy->policy;
+    }
+
+    name[0] = 0;
+    if (!GetString(env, object, "scaler", name, sizeof(name))) {
+        return false;
+    }
+    if (name[0]) {
+        const ScalerName* scaler = FindName(scalers, name);
+        if (!scaler) {
+            return false;
+        }
+        options->scaler = scaler->flags;
+    }
+
+    // motion: true, or { threshold, blockThreshold, sceneThreshold,
+    // roi: [{ x, y, width, height }] } with the ROI in fractions of the
+    // picture. Packet mode has no decoded frames to gate.
+    if (napi_has_named_property(env, object, "motion", &has) != napi_ok) {
+        return false;
+    }
+    if (has) {
+        napi_value motion;
+        if (napi_get_named_property(env, object, "motion", &motion) != napi_ok ||
+            napi_typeof(env, motion, &type) != napi_ok) {
+            return false;
+        }
+        if (type == napi_boolean) {
+            napi_get_value_bool(env, motion, &options->motion.enabled);
+        } else if (type == napi_object) {
+            options->motion.enabled = true;
+            if (!GetDouble(env, motion, "threshold", &options->motion.threshold) || options->motion.threshold < 0 ||
+                !GetInt(env, motion, "blockThreshold", &options->motion.block_threshold) ||
+                options->motion.block_threshold < 0 || options->motion.block_threshold > 255 ||
+                !GetDouble(env, motion, "sceneThreshold", &options->motion.scene_threshold)) {
+                return false;
+            }
+            
+            if (napi_has_named_property(env, motion, "roi", &has) != napi_ok) {
+                return false;
+            }
+            if (has) {
+                napi_value roi;
+                bool is_array = false;
+                uint32_t length = 0;
+                if (napi_get_named_property(env, motion, "roi", &roi) != napi_ok ||
+                    napi_is_array(env, roi, &is_array) != napi_ok || !is_array ||
+                    napi_get_array_length(env, roi, &length) != napi_ok) {
+                    return false;
+                }
+                for (uint32_t i = 0; i < length; i++) {
+                    napi_value element;
+                    Region region = { 0, 0, 1, 1 };
+                    if (napi_get_element(env, roi, i, &element) != napi_ok ||
+                        napi_typeof(env, element, &type) != napi_ok || type != napi_object ||
+                        !GetDouble(env, element, "x", &region.x) ||
+                        !GetDouble(env, element, "y", &region.y) ||
+                        !GetDouble(env, element, "width", &region.width) ||
+                        !GetDouble(env, element, "height", &region.height) ||
+                        region.width <= 0 || region.height <= 0) {
+                        return false;
+                    }
+                    options->motion.roi.push_back(region);
+                }
+            }
+        } else if (type != napi_undefined) {
+            return false;
+        }
+    }
+
+    // outputs: [{ width, height, format, scaler }], each defaulting to the
+    // top-level format and scaler. Passthrough frames are not converted,
+    // so they cannot have profiles.
+    if (napi_has_named_property(env, object, "outputs", &has) != napi_ok) {
+        return false;
+    }
+    if (has) {
+        napi_value outputs;
+        bool is_array = false;
+        uint32_t length = 0;
+        if (napi_get_named_property(env, object, "outputs", &outputs) != napi_ok ||
+            napi_is_array(env, outputs, &is_array) != napi_ok || !is_array ||
+            napi_get_array_length(env, outputs, &length) != napi_ok ||
+            length < 1 || length > AVContext::MAX_OUTPUTS || options->passthrough) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < length; i++) {
+            napi_value output;
+            if (napi_get_element(env, outputs, i, &output) != napi_ok ||
+                napi_typeof(env, output, &type) != napi_ok || type != napi_object) {
+                return false;
+            }
+
+            OutputOptions profile;
+            profile.format = options->format;
+            profile.scaler = options->scaler;
+            profile.jpeg = options->jpeg;
+            profile.quality = options->quality;
+            if (!GetInt(env, output, "width", &profile.width) ||
+                !GetInt(env, output, "height", &profile.height) ||
+                !GetInt(env, output, "quality", &profile.quality) || profile.quality < 1 || profile.quality > 100) {
+                return false;
+            }
+
+            name[0] = 0;
+            if (!GetString(env, output, "format", name, sizeof(name))) {
+                return false;
+            }
+            if (strcmp(name, "jpeg") == 0) {
+                profile.jpeg = true;
+                profile.format = AV_PIX_FMT_YUVJ420P;
+            } else if (name[0]) {
+                const PixelFormatName* pixel_format = FindName(pixel_formats, name);
+                if (!pixel_format || pixel_format->format == AV_PIX_FMT_NONE) {
+                    return false;
+                }
+                profile.jpeg = false;
+                profile.format = pixel_format->format;
+            }
+
+            name[0] = 0;
+            if (!GetString(env, output, "scaler", name, sizeof(name))) {
+                return false;
+            }
+            if (name[0]) {
+                const ScalerName* scaler = FindName(scalers, name);
+                if (!scaler) {
+                    return false;
+                }
+                profile.scaler = scaler->flags;
+            }
+
+            options->outputs.push_back(profile);
+        }
+    }
+
+    return true;
+}
+
+
+static void SetTimestamp(napi_env env, napi_value object, const char* name, int64_t ts) {
+    napi_value value;
+    if (ts == AV_NOPTS_VALUE) {
+        napi_get_null(env, &value);
+    } else if (napi_create_double(env, (double)ts, &value) != napi_ok) {
+        return;
+    }
+    napi_set_named_property(env, object, name, value);
+}
+
+static void ReleasePacket(napi_env env, void* data, void* hint) {
+    AVPacket* packet = static_cast<AVPacket*>(hint);
+    av_packet_free(&packet);
+}
+
+// Wraps a compressed packet; the payload Buffer owns the packet.
+static napi_value PacketValue(napi_env env, FrameOutput* output) {
+    AVPacket* packet = output->packet;
+    
+    napi_value result, data;
+    if (napi_create_object(env, &result) != napi_ok) {
+        return NULL;
+    }
+    
+    SetNumber(env, result, "streamIndex", packet->stream_index);
+    SetTimestamp(env, result, "pts", packet->pts);
+    SetTimestamp(env, result, "dts", packet->dts);
+    SetNumber(env, result, "duration", (double)packet->duration);
+    
+    napi_value keyframe;
+    napi_get_boolean(env, (packet->flags & AV_PKT_FLAG_KEY) != 0, &keyframe);
+    napi_set_named_property(env, result, "keyframe", keyframe);
+    
+    if (napi_create_external_buffer(env,
+                                    packet->size,
+                                    packet->data,
+                                    ReleasePacket,
+                                    packet,
+                                    &data) != napi_ok) {
+        return NULL;
+    }
+    output->packet = NULL;
+    
+    napi_set_named_property(env, result, "data", data);
+    return result;
+}
+
+static napi_value StreamsValue(napi_env env, const std::vector<StreamInfo>& streams) {
+    napi_value result;
+    if (napi_create_array_with_length(env, streams.size(), &result) != napi_ok) {
+        return NULL;
+    }
+    
+    for (size_t i = 0; i < streams.size(); i++) {
+        const StreamInfo& info = streams[i];
+        
+        napi_value stream, time_base, num, den, extradata;
+        napi_create_object(env, &stream);
+        SetNumber(env, stream, "index", info.index);
+        SetString(env, stream, "type", info.type.c_str());
+        SetString(env, stream, "codec", info.codec.c_str());
+        SetNumber(env, stream, "width", info.width);
+        SetNumber(env, stream, "height", info.height);
+        
+        napi_create_array_with_length(env, 2, &time_base);
+        napi_create_int32(env, info.time_base.num, &num);
+        napi_create_int32(env, info.time_base.den, &den);
+        napi_set_element(env, time_base, 0, num);
+        napi_set_element(env, time_base, 1, den);
+        napi_set_named_property(env, stream, "timeBase", time_base);
+        
+        void* data = NULL;
+        if (napi_create_buffer_copy(env, info.extradata.size(), info.extradata.data(), &data, &extradata) == napi_ok) {
+            napi_set_named_property(env, stream, "extradata", extradata);
+        }
+        
+        napi_set_element(env, result, (uint32_t)i, stream);
+    }
+    return result;
+}
+
+// Hands a frame over to JS; the output gives up ownership of its memory.
+static napi_value FrameValue(napi_env env, FrameOutput* output);
+
+// Adds the motion gate's findings to a delivered frame: the score, whether
+// it looks like a scene change, and one activity byte per 32x32 block,
+// row by row.
+static void SetMotion(napi_env env, napi_value result, FrameOutput* output) {
+    napi_value scene, activity;
+    SetNumber(env, result, "motion", output->motion);
+    if (napi_get_boolean(env, output->scene, &scene) == napi_ok) {
+        napi_set_named_property(env, result, "scene", scene);
+    }
+    if (!output->activity.empty() &&
+        napi_create_buffer_copy(env, output->activity.size(), &output->activity[0], NULL, &activity) == napi_ok) {
+        napi_set_named_property(env, result, "activity", activity);
+        SetNumber(env, result, "activityColumns", output->activity_columns);
+    }
+}
+
+// Delivers a frame produced by ctx, keeping its stats and trace.
+static napi_value DeliverFrame(napi_env env, AVContext* ctx, FrameOutput* output) {
+    int64_t start = av_gettime_relative();
+    napi_value result = FrameValue(env, output);
+    int64_t now = av_gettime_relative();
+    
+    ctx->stats.deliver.record(now - start);
+    if (result != NULL && !std::isnan(output->motion)) {
+        SetMotion(env, result, output);
+    }
+    if (result != NULL) {
+        ctx->stats.frames_delivered++;
+        ctx->trace.add(output->pts, output->received, output->decoded, now);
+    }
+    return result;
+}
+
+static napi_value FrameValue(napi_env env, FrameOutput* output) {
+    napi_value result = NULL;
+    if (output->packet) {
+        return PacketValue(env, output);
+    }
+    
+    if (output->frame) {
+        return Planes(env, output->frame);
+    }
+    
+    // With `outputs`, an array of one Buffer per profile, in order.
+    if (!output->profiles.empty()) {
+        if (napi_create_array_with_length(env, output->profiles.size(), &result) != napi_ok) {
+            return NULL;
+        }
+        for (size_t i = 0; i < output->profiles.size(); i++) {
+            napi_value value = FrameValue(env, output->profiles[i]);
+            if (value == NULL) {
+                return NULL;
+            }
+            napi_set_element(env, result, (uint32_t)i, value);
+        }
+        return result;
+    }
+    
+    // A frame published to the ring: where to find it.
+    if (output->slot >= 0) {
+        if (napi_create_object(env, &result) != napi_ok) {
+            return NULL;
+        }
+        SetNumber(env, result, "seq", output->seq);
+        SetNumber(env, result, "slot", output->slot);
+        SetNumber(env, result, "width", output->width);
+        SetNumber(env, result, "height", output->height);
+        SetString(env, result, "format", FormatName((AVPixelFormat)output->format));
+        return result;
+    }
+    
+    // A JPEG Buffer owns its packet.
+    if (output->jpeg) {
+        AVPacket* jpeg = output->jpeg;
+        if (napi_create_external_buffer(env,
+                                        jpeg->size,
+                                        jpeg->data,
+                                        ReleasePacket,
+                                        jpeg,
+                                        &result) != napi_ok) {
+            return NULL;
+        }
+        output->jpeg = NULL;
+        SetNumber(env, result, "width", output->width);
+        SetNumber(env, result, "height", output->height);
+        SetString(env, result, "format", "jpeg");
+        return result;
+    }
+    
+    FrameLease* lease = output->lease;
+    if (napi_create_external_buffer(env, 
+                                    lease->size, 
+                                    lease->data,
+                                    ReleaseLease,
+                                    lease,
+                                    &result) != napi_ok){
+        return NULL;
+    }
+    
+    output->lease = NULL;
+    SetNumber(env, result, "width", output->width);
+    SetNumber(env, result, "height", output->height);
+    SetString(env, result, "format", FormatName((AVPixelFormat)output->format));
+    return result;
+}
+
+static napi_value HistogramValue(napi_env env, const Histogram& histogram) {
+    Histogram::Summary summary = histogram.summary();
+    
+    napi_value result;
+    if (napi_create_object(env, &result) != napi_ok) {
+        return NULL;
+    }
+    SetNumber(env, result, "count", (double)summary.count);
+    SetNumber(env, result, "mean", summary.mean);
+    SetNumber(env, result, "p50", (double)summary.p50);
+    SetNumber(env, result, "p90", (double)summary.p90);
+    SetNumber(env, result, "p99", (double)summary.p99);
+    SetNumber(env, result, "max", (double)summary.max);
+    return result;
+}
+
+// Stage timings and jitter are in microseconds. Queue figures are zero
+// for streams that are not queued.
+static napi_value StatsValue(napi_env env, const StreamStats& stats, int queue_depth, uint64_t queue_dropped) {
+    napi_value result;
+    if (napi_create_object(env, &result) != napi_ok) {
+        return NULL;
+    }
+    SetNumber(env, result, "packets", (double)stats.packets);
+    SetNumber(env, result, "bytesIn", (double)stats.bytes_in);
+    SetNumber(env, result, "framesDecoded", (double)stats.frames_decoded);
+    SetNumber(env, result, "framesDelivered", (double)stats.frames_delivered);
+    SetNumber(env, result, "framesDropped", (double)(stats.frames_dropped + queue_dropped));
+    SetNumber(env, result, "framesStill", (double)stats.frames_still);
+    SetNumber(env, result, "queueDepth", queue_depth);
+    SetNumber(env, result, "reconnects", (double)stats.reconnects);
+    SetNumber(env, result, "recorderDropped", (double)stats.recorder_dropped);
+    SetNumber(env, result, "timeToFirstFrame", (double)stats.time_to_first_frame);
+    SetNumber(env, result, "width", stats.width);
+    SetNumber(env, result, "height", stats.height);
+    SetString(env, result, "codec", stats.codec_id == AV_CODEC_ID_NONE ? "" : avcodec_get_name((AVCodecID)stats.codec_id.load()));
+    napi_set_named_property(env, result, "demux", HistogramValue(env, stats.demux));
+    napi_set_named_property(env, result, "decode", HistogramValue(env, stats.decode));
+    napi_set_named_property(env, result, "convert", HistogramValue(env, stats.convert));
+    napi_set_named_property(env, result, "deliver", HistogramValue(env, stats.deliver));
+    napi_set_named_property(env, result, "jitter", HistogramValue(env, stats.jitter));
+    SetNumber(env, result, "bytesOut", (double)stats.bytes_out);
+    SetNumber(env, result, "bytesCopied", (double)stats.bytes_copied);
+    return result;
+}
+
+// The trace as a Float64Array of [pts, received, decoded, delivered] rows.
+static napi_value TraceValue(napi_env env, const FrameTrace& trace) {
+    size_t length = trace.count() * FrameTrace::FIELDS;
+    void* data = NULL;
+    napi_value buffer, result;
+    if (napi_create_arraybuffer(env, length * sizeof(double), &data, &buffer) != napi_ok ||
+        napi_create_typedarray(env, napi_float64_array, length, buffer, 0, &result) != napi_ok) {
+        return NULL;
+    }
+    trace.copy(static_cast<double*>(data));
+    return result;
+}
+
+static napi_value CreateError(napi_env env, const char* error) {
+    napi_value message, err;
+    napi_create_string_utf8(env, error, NAPI_AUTO_LENGTH, &message);
+    napi_create_error(env, NULL, message, &err);
+    return err;
+}
+
+class Wrapper;
+
+// One pending open()/read() call. It is filled in on the worker thread and
+// settled on the JS thread, so it must own everything the result needs.
+struct Job {
+    enum Kind { OPEN, READ, RECORD };
+    
+    Kind kind;
+    Wrapper* owner = NULL;
+    napi_deferred deferred = NULL;
+    int status = 0;
+    FrameOutput output;
+    std::vector<StreamInfo> streams;
+};
+
+// Frames decoded ahead of JS when open() is given a queueSize. The worker
+// thread keeps draining the socket and pushes here; read() takes from the
+// front, or parks its job until the next frame arrives.
+class FrameQueue {
+public:
+    enum Policy { DROP_OLDEST = 0, LATEST = 1, BLOCK = 2 };
+    
+    ~FrameQueue(){ clear(); }
+    
+    // Arms the queue for a new open(); called on the JS thread. The ingest
+    // loop of a previous open() may still be winding down, so pushes and
+    // ends carry the generation they belong to.
+    uint64_t reset(const StreamOptions& options) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        clear();
+        _generation++;
+        _policy = (Policy)options.drop_policy;
+        _capacity = _policy == LATEST ? 1 : options.queue_size;
+        _max_latency = (int64_t)options.max_latency * 1000;
+        _ended = false;
+        _aborted = false;
+        _status = 0;
+        _space.notify_all();
+        return _generation;
+    }
+    
+    bool enabled() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _capacity > 0;
+    }
+    
+    // Takes ownership of output. Returns a parked job that now holds the
+    // frame and must be finished by the caller, or NULL.
+    Job* push(FrameOutput* output, uint64_t generation) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (generation != _generation) {
+            delete output;
+            return NULL;
+        }
+        if (!_waiting.empty()) {
+            Job* job = _waiting.front();
+            _waiting.pop_front();
+            job->output.swap(*output);
+            delete output;
+            return job;
+        }
+        
+        if (_policy == BLOCK) {
+            _space.wait(lock, [this, generation]{
+                return _aborted || generation != _generation || _frames.size() < (size_t)_capacity;
+            });
+        }
+        if (_aborted || generation != _generation) {
+            delete output;
+            return NULL;
+        }
+        
+        while (_frames.size() >= (size_t)_capacity) {
+            delete _frames.front();
+            _frames.pop_front();
+            _dropped++;
+        }
+        _frames.push_back(output);
+        return NULL;
+    }
+    
+    // Fills job from the oldest fresh frame or the end status. Returns
+    // false when nothing is ready; the job is then parked until push().
+    bool take(Job* job) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        
+        int64_t now = av_gettime_relative();
+        while (!_frames.empty() && _max_latency > 0 && now - _frames.front()->received > _max_latency) {
+            delete _frames.front();
+            _frames.pop_front();
+            _dropped++;
+            _expired++;
+        }
+        
+        if (!_frames.empty()) {
+            job->output.swap(*_frames.front());
+            delete _frames.front();
+            _frames.pop_front();
+            _space.notify_one();
+            return true;
+        }
+        
+        if (_ended) {
+            job->status = _status;
+            return true;
+        }
+        
+        _waiting.push_back(job);
+        return false;
+    }
+    
+    // The stream stopped with status; returns the parked jobs, which the
+    // caller must finish.
+    std::deque<Job*> end(int status, uint64_t generation) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (generation != _generation) {
+            return std::deque<Job*>();
+        }
+        _ended = true;
+        _status = status;
+        std::deque<Job*> waiting;
+        waiting.swap(_waiting);
+        for (size_t i = 0; i < waiting.size(); i++) {
+            waiting[i]->status = status;
+        }
+        return waiting;
+    }
+    
+    // Releases an ingest thread blocked on a full queue.
+    void abort() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _aborted = true;
+        }
+        _space.notify_all();
+    }
+    
+    struct Stats {
+        int capacity;
+        int depth;
+        uint64_t dropped;
+        uint64_t expired;
+    };
+    
+    Stats stats() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return Stats{ _capacity, (int)_frames.size(), _dropped, _expired };
+    }
+    
+private:
+    void clear() {
+        for (size_t i = 0; i < _frames.size(); i++) {
+            delete _frames[i];
+        }
+        _frames.clear();
+    }
+    
+    std::mutex _mutex;
+    std::condition_variable _space;
+    std::deque<FrameOutput*> _frames;
+    std::deque<Job*> _waiting;
+    Policy _policy = DROP_OLDEST;
+    int _capacity = 0;
+    int64_t _max_latency = 0;
+    bool _ended = false;
+    bool _aborted = false;
+    int _status = 0;
+    uint64_t _generation = 0;
+    uint64_t _dropped = 0;
+    uint64_t _expired = 0;
+};
+
+class Wrapper {
+public:
+    Wrapper(){}
+    
+    ~Wrapper(){
+        if (_ctx) { _ctx->abort(); }
+        if (_queue) { _queue->abort(); }
+        if (_worker) { delete _worker; }
+        if (_queue) { delete _queue; }
+        if (_ctx) { delete _ctx; }
+        if (_tsfn) { napi_release_threadsafe_function(_tsfn, napi_tsfn_abort); }
+        
+        for (size_t i = 0; i < _rings.size(); i++) {
+            napi_delete_reference(_env, _rings[i]);
+        }
+        napi_delete_reference(_env, _wrapper);
+    }
+    
+    static napi_value Init(napi_env env, napi_value exports){
+        
+        napi_property_descriptor properties[] = {
+          { "open", 0, open, 0, 0, 0, napi_default, 0 },
+          { "read", 0, read, 0, 0, 0, napi_default, 0 },
+          { "record", 0, record, 0, 0, 0, napi_default, 0 },
+          { "close", 0, close, 0, 0, 0, napi_default, 0 },
+          { "release", 0, release, 0, 0, 0, napi_default, 0 },
+          { "getPoolStats", 0, getPoolStats, 0, 0, 0, napi_default, 0 },
+          { "getQueueStats", 0, getQueueStats, 0, 0, 0, napi_default, 0 },
+          { "getStats", 0, getStats, 0, 0, 0, napi_default, 0 },
+          { "getTrace", 0, getTrace, 0, 0, 0, napi_default, 0 },
+          { "setRing", 0, setRing, 0, 0, 0, napi_default, 0 }
+        };
+        
+        napi_value cons;
+        if (napi_define_class(env,
+                        "Rtsp",
+                        NAPI_AUTO_LENGTH,
+                        New, 
+                        NULL, 
+                        sizeof(properties) / sizeof(properties[0]), 
+                        properties,
+                        &cons) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_define_class");
+            return NULL;
+        }
+        
+       napi_ref* cons_ref = new napi_ref;
+       if (napi_create_reference(env, cons, 1, cons_ref) != napi_ok){
+            napi_throw_error(env, NULL, "napi_create_reference");
+            return NULL;
+       }
+       
+       if (napi_set_instance_data(env, 
+                             cons_ref,
+                             [](napi_env env, void* data, void* hint) {
+                                napi_ref* cons_ref = static_cast<napi_ref*>(data);
+                                napi_delete_reference(env, *cons_ref);
+                                delete cons_ref;
+                             },
+                             NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_set_instance_data");
+            return NULL;
+        }
+                             
+       if (napi_set_named_property(env, exports, "Rtsp", cons) != napi_ok) {
+           napi_throw_error(env, NULL, "napi_set_named_property");
+           return NULL;
+       }
+       
+       return exports;
+    }
+    
+    static napi_value New(napi_env env, napi_callback_info info) {
+
+        napi_value target;
+        if (napi_get_new_target(env, info, &target) != napi_ok){
+           napi_throw_error(env, NULL, "napi_get_new_target");
+           return NULL;
+        }
+        
+        if (target != NULL) {
+            size_t argc = 1;
+            napi_value args[1];
+            napi_value _this;
+            if (napi_get_cb_info(env, info, &argc, args, &_this, NULL) != napi_ok){
+                napi_throw_error(env, NULL, "napi_get_cb_info");
+                return NULL;
+            }
+            
+            Wrapper* obj = new Wrapper();
+            obj->_env = env;
+            obj->_ctx = new AVContext();
+            
+            napi_value name;
+            if (napi_create_string_utf8(env, "Rtsp", NAPI_AUTO_LENGTH, &name) != napi_ok) {
+                napi_throw_error(env, NULL, "napi_create_string_utf8");
+                return NULL;
+            }
+            
+            if (napi_create_threadsafe_function(env,
+                                                NULL,
+                                                NULL,
+                                                name,
+                                                0,
+                                                1,
+                                                NULL,
+                                                NULL,
+                                                NULL,
+                                                Complete,
+                                                &obj->_tsfn) != napi_ok) {
+                napi_throw_error(env, NULL, "napi_create_threadsafe_function");
+                return NULL;
+            }
+            
+            // Only keep the event loop alive while a call is in flight.
+            napi_unref_threadsafe_function(env, obj->_tsfn);
+            
+            obj->_queue = new FrameQueue();
+            obj->_worker = new Worker();
+            
+            if (napi_wrap(env,
+                      _this,
+                      reinterpret_cast<void*>(obj),
+                      Wrapper::Destructor,
+                      NULL, 
+                      &obj->_wrapper) != napi_ok) {
+                napi_throw_error(env, NULL, "napi_wrap");
+                return NULL;
+            }
+                      
+            return _this;
+        }else {
+            
+            size_t argc = 1;
+            napi_value args[1];
+            if (napi_get_cb_info(env, info, &argc, args, NULL, NULL) != napi_ok ){
+                napi_throw_error(env, NULL, "napi_get_cb_info");
+                return NULL;
+            }
+
+            napi_value argv[] = { args[0] };
+
+            napi_value instance;
+            if (napi_new_instance(env, 
+                              Constructor(env), 
+                              sizeof(argv) / sizeof(argv[0]), 
+                              argv, 
+                              &instance) != napi_ok) {
+                napi_throw_error(env, NULL, "napi_new_instance");
+                return NULL;
+            }
+           
+            return instance;
+        }
+    }
+    
+    static napi_value Constructor(napi_env env){
+        void* data = NULL;
+        if (napi_get_instance_data(env, &data) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_instance_data");
+            return NULL;
+        }
+
+        napi_ref* cons_ref = static_cast<napi_ref*>(data);
+        
+        napi_value cons;
+        if (napi_get_reference_value(env, *cons_ref, &cons) != napi_ok){
+            napi_throw_error(env, NULL, "napi_get_reference_value");
+            return NULL;
+        }
+        return cons;
+    }
+    
+    static void Destructor(napi_env env, void* data, void* hint){
+        reinterpret_cast<Wrapper*>(data)->~Wrapper();
+    }
+    
+    // Creates the promise for a job and pins the JS object until it settles.
+    static napi_value Begin(napi_env env, Wrapper* obj, Job* job) {
+        napi_value promise;
+        if (napi_create_promise(env, &job->deferred, &promise) != napi_ok) {
+            delete job;
+            napi_throw_error(env, NULL, "napi_create_promise");
+            return NULL;
+        }
+        
+        job->owner = obj;
+        uint32_t refs = 0;
+        napi_reference_ref(env, obj->_wrapper, &refs);
+        if (obj->_pending++ == 0) {
+            napi_ref_threadsafe_function(env, obj->_tsfn);
+        }
+        return promise;
+    }
+    
+    // Called on the worker thread once a job has its result.
+    static void Finish(Job* job) {
+        napi_call_threadsafe_function(job->owner->_tsfn, job, napi_tsfn_blocking);
+    }
+    
+    // Settles a job's promise on the JS thread.
+    static void Complete(napi_env env, napi_value js_cb, void* context, void* data) {
+        Job* job = static_cast<Job*>(data);
+        if (env == NULL) {
+            delete job;
+            return;
+        }
+        
+        Wrapper* obj = job->owner;
+        if (--obj->_pending == 0) {
+            napi_unref_threadsafe_function(env, obj->_tsfn);
+        }
+        uint32_t refs = 0;
+        napi_reference_unref(env, obj->_wrapper, &refs);
+        
+        napi_value result = NULL;
+        const char* error = NULL;
+        
+        if (job->kind == Job::OPEN) {
+            if (job->status < 0) {
+                error = "open";
+            } else {
+                result = StreamsValue(env, job->streams);
+            }
+        } else if (job->kind == Job::RECORD) {
+            if (job->status < 0) {
+                error = "record";
+            }
+        } else {
+            switch (job->status) {
+                case 0: {
+                    bool published = job->output.slot >= 0;
+                    result = DeliverFrame(env, obj->_ctx, &job->output);
+                    if (result == NULL) {
+                        error = "napi_create_external_buffer";
+                    } else if (published) {
+                        Notify(env, obj);
+                    }
+                    break;
+                }
+                
+                case -3: 
+                    break;
+                
+                case -6:
+                    error = "ring slot too small";
+                    break;
+                
+                default:
+                    error = "read";
+                    break;
+            }
+        }
+        
+        if (error) {
+            napi_reject_deferred(env, job->deferred, CreateError(env, error));
+        } else {
+            if (result == NULL) {
+                napi_get_null(env, &result);
+            }
+            napi_resolve_deferred(env, job->deferred, result);
+        }
+        
+        delete job;
+    }
+    
+    static napi_value open(napi_env env, napi_callback_info info) {
+        size_t argc = 2;
+        napi_value args[2];
+        napi_value _this;
+        if (napi_get_cb_info(env, info, &argc, args, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+        
+        size_t len = 0;
+        if (napi_get_value_string_utf8(env, args[0], NULL, 0, &len) != napi_ok){
+            napi_throw_error(env, NULL, "napi_get_value_string_utf8");
+            return NULL;
+        }
+        
+        std::string url(len, '\0');
+        if (napi_get_value_string_utf8(env, args[0], &url[0], len + 1, &len) != napi_ok){
+            napi_throw_error(env, NULL, "napi_get_value_string_utf8");
+            return NULL;
+        }
+
+        StreamOptions options;
+        if (argc > 1 && !GetOptions(env, args[1], &options)) {
+            napi_throw_type_error(env, NULL, "options");
+            return NULL;
+        }
+        const char* conflict = obj->_ring ? RingConflict(options) : NULL;
+        if (conflict) {
+            napi_throw_type_error(env, NULL, conflict);
+            return NULL;
+        }
+
+        Job* job = new Job();
+        job->kind = Job::OPEN;
+        napi_value promise = Begin(env, obj, job);
+        if (promise == NULL) {
+            return NULL;
+        }
+        
+        ctx->trace.reset(options.trace);
+        obj->_options = options;
+        
+        FrameQueue* queue = obj->_queue;
+        uint64_t generation = queue->reset(options);
+        
+        obj->_worker->post([ctx, job, url, options, queue, generation]() {
+            ctx->options = options;
+            job->status = ctx->open(url.c_str());
+            if (job->status == 0) {
+                Describe(ctx->format_ctx, &job->streams);
+            }
+            int status = job->status;
+            Finish(job);
+            
+            if (options.queue_size > 0 || options.drop_policy == FrameQueue::LATEST) {
+                Ingest(ctx, queue, generation, status < 0 ? -2 : 0);
+            }
+        });
+
+        return promise;
+    }
+    
+    // The worker's loop when frames are queued ahead of JS: it keeps the
+    // stream drained until it ends, fails or is closed.
+    static void Ingest(AVContext* ctx, FrameQueue* queue, uint64_t generation, int ret) {
+        while (ret == 0 && !ctx->aborted) {
+            ret = ctx->read();
+            if (ret == -1) {
+                ret = 0;
+                continue;
+            }
+            if (ret == -4) {
+                // Waiting to reconnect.
+                av_usleep(5000);
+                ret = 0;
+                continue;
+            }
+            if (ret != 0) {
+                break;
+            }
+            
+            FrameOutput* output = new FrameOutput();
+            ret = Produce(ctx, output);
+            if (ret < 0) {
+                delete output;
+                break;
+            }
+            
+            Job* job = queue->push(output, generation);
+            if (job) {
+                Finish(job);
+            }
+        }
+        
+        std::deque<Job*> waiting = queue->end(ret == -3 || ret == -6 ? ret : -2, generation);
+        for (size_t i = 0; i < waiting.size(); i++) {
+            Finish(waiting[i]);
+        }
+    }
+    
+    static napi_value read(napi_env env, napi_callback_info info) {
+       napi_value _this;
+        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+
+        Job* job = new Job();
+        job->kind = Job::READ;
+        napi_value promise = Begin(env, obj, job);
+        if (promise == NULL) {
+            return NULL;
+        }
+        
+        // Queued frames settle right here, without a trip to the worker.
+        if (obj->_queue->enabled()) {
+            if (obj->_queue->take(job)) {
+                Complete(env, NULL, NULL, job);
+            }
+            return promise;
+        }
+        
+        obj->_worker->post([ctx, job]() {
+            if (!ctx->format_ctx || ctx->aborted) {
+                job->status = -2;
+                Finish(job);
+                return;
+            }
+            
+            // Skip packets of other streams so that JS only sees frames, and
+            // sit out reconnect back-offs.
+            int ret;
+            do {
+                ret = ctx->read();
+                if (ret == -4) {
+                    av_usleep(5000);
+                }
+            } while ((ret == -1 || ret == -4) && !ctx->aborted);
+            
+            if (ret == 0) {
+                ret = Produce(ctx, &job->output);
+            } else if (ret == -1 || ret == -4) {
+                ret = -2;
+            }
+            
+            job->status = ret;
+            Finish(job);
+        });
+
+        return promise;
+    }
+    
+    // Keeps demuxing into the recorder, without decoding, until the stream
+    // ends or close() is called. Reads queued meanwhile run afterwards.
+    static napi_value record(napi_env env, napi_callback_info info) {
+        napi_value _this;
+        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+
+        Job* job = new Job();
+        job->kind = Job::RECORD;
+        napi_value promise = Begin(env, obj, job);
+        if (promise == NULL) {
+            return NULL;
+        }
+        
+        obj->_worker->post([ctx, job]() {
+            if (!ctx->format_ctx || !ctx->recorder) {
+                job->status = -2;
+                Finish(job);
+                return;
+            }
+            
+            int ret;
+            do {
+                av_packet_unref(ctx->packet);
+                ret = ctx->demux();
+            } while (ret == 0);
+            av_packet_unref(ctx->packet);
+            
+            job->status = ret == -3 || ctx->aborted ? 0 : ret;
+            Finish(job);
+        });
+
+        return promise;
+    }
+    
+    static napi_value close(napi_env env, napi_callback_info info) {
+        napi_value _this;
+        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+        
+        // Interrupt a read in progress and release the stream once the
+        // worker reaches this point; queued calls reject with "read".
+        ctx->abort();
+        obj->_queue->abort();
+        obj->_worker->post([ctx]() {
+            ctx->close();
+        });
+        return NULL;
+    }
+    
+    // Returns a frame's buffer to the pool before it is garbage collected.
+    // The Buffer must not be used afterwards: its memory will be reused.
+    static napi_value release(napi_env env, napi_callback_info info) {
+        size_t argc = 1;
+        napi_value args[1];
+        napi_value _this;
+        if (napi_get_cb_info(env, info, &argc, args, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+        
+        void* data = NULL;
+        size_t size = 0;
+        if (napi_get_buffer_info(env, args[0], &data, &size) != napi_ok) {
+            napi_throw_type_error(env, NULL, "napi_get_buffer_info");
+            return NULL;
+        }
+        
+        napi_value result;
+        napi_get_boolean(env, ctx->release(data), &result);
+        return result;
+    }
+    
+    static napi_value getPoolStats(napi_env env, napi_callback_info info) {
+        napi_value _this;
+        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+        
+        FramePool::Stats stats = ctx->pool_stats();
+        
+        napi_value result;
+        if (napi_create_object(env, &result) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_create_object");
+            return NULL;
+        }
+        
+        SetNumber(env, result, "size", stats.slots);
+        SetNumber(env, result, "free", stats.free);
+        SetNumber(env, result, "inUse", stats.slots - stats.free);
+        SetNumber(env, result, "acquired", (double)stats.acquired);
+        SetNumber(env, result, "exhausted", (double)stats.exhausted);
+        return result;
+    }
+    
+    static napi_value getStats(napi_env env, napi_callback_info info) {
+        napi_value _this;
+        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        
+        FrameQueue::Stats queue = obj->_queue->stats();
+        napi_value result = StatsValue(env, obj->_ctx->stats, queue.depth, queue.dropped);
+        if (result == NULL) {
+            napi_throw_error(env, NULL, "napi_create_object");
+            return NULL;
+        }
+        return result;
+    }
+    
+    static napi_value getTrace(napi_env env, napi_callback_info info) {
+        napi_value _this;
+        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        
+        napi_value result = TraceValue(env, obj->_ctx->trace);
+        if (result == NULL) {
+            napi_throw_error(env, NULL, "napi_create_typedarray");
+            return NULL;
+        }
+        return result;
+    }
+    
+    // A ring slot holds one raw image, so options producing anything else
+    // cannot use one. Returns why, or NULL when they can.
+    static const char* RingConflict(const StreamOptions& options) {
+        if (options.passthrough) {
+            return "ring: format 'native' is not supported";
+        }
+        if (options.packets) {
+            return "ring: packets are not supported";
+        }
+        if (!options.outputs.empty()) {
+            return "ring: outputs are not supported";
+        }
+        if (options.jpeg) {
+            return "ring: jpeg is not supported";
+        }
+        return NULL;
+    }
+    
+    // setRing(view, slots) publishes frames into a SharedArrayBuffer seen
+    // through an Int32Array; see FrameRing for the layout. setRing(null)
+    // goes back to Buffers. A ring's memory stays referenced until this
+    // object is collected, since the worker may still be writing to it.
+    static napi_value setRing(napi_env env, napi_callback_info info) {
+        size_t argc = 2;
+        napi_value args[2];
+        napi_value _this;
+        if (napi_get_cb_info(env, info, &argc, args, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
+        }
+
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
+        }
+        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+        
+        napi_valuetype type = napi_undefined;
+        if (argc > 0 && napi_typeof(env, args[0], &type) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_typeof");
+            return NULL;
+        }
+        if (type == napi_undefined || type == napi_null) {
+            std::atomic_store(&ctx->ring, std::shared_ptr<FrameRing>());
+            obj->_ring = NULL;
+            return NULL;
+        }
+        
+        bool is_typedarray = false;
+        napi_typedarray_type array_type;
+        size_t length = 0;
+        void* data = NULL;
+        int32_t slots = 0;
+        if (argc < 2 ||
+            napi_is_typedarray(env, args[0], &is_typedarray) != napi_ok || !is_typedarray ||
+            napi_get_typedarray_info(env, args[0], &array_type, &length, &data, NULL, NULL) != napi_ok ||
+            array_type != napi_int32_array ||
+            napi_get_value_int32(env, args[1], &slots) != napi_ok || slots < 1) {
+            napi_throw_type_error(env, NULL, "setRing");
+            return NULL;
+        }
+        const char* conflict = RingConflict(obj->_options);
+        if (conflict) {
+            napi_throw_type_error(env, NULL, conflict);
+            return NULL;
+        }
+        
+        std::shared_ptr<FrameRing> ring = std::make_shared<FrameRing>((uint8_t*)data, length * sizeof(int32_t), slots);
+        if (!ring->valid()) {
+            napi_throw_range_error(env, NULL, "setRing");
+            return NULL;
+        }
+        
+        napi_ref ref;
+        if (napi_create_reference(env, args[0], 1, &ref) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_create_reference");
+            return NULL;
+        }
+        obj->_rings.push_back(ref);
+        obj->_ring = ref;
+        std::atomic_store(&ctx->ring, ring);
+        return NULL;
+    }
+    
+    // Wakes readers blocked in Atomics.wait() on the published word.
+    static void Notify(napi_env env, Wrapper* obj) {
+        napi_value global, atomics, notify, argv[2];
+        if (obj->_ring == NULL ||
+            napi_get_reference_value(env, obj->_ring, &argv[0]) != napi_ok ||
+            napi_create_int32(env, 3, &argv[1]) != napi_ok ||
+            napi_get_global(env, &global) != napi_ok ||
+            napi_get_named_property(env, global, "Atomics", &atomics) != napi_ok ||
+            napi_get_named_property(env, atomics, "notify", &notify) != napi_ok) {
+            return;
+        }
+        napi_call_function(env, atomics, notify, 2, argv, NULL);
+    }
+    
+    static napi_value getQueueStats(napi_env env, napi_callback_info info) {
+        napi_value _this;
+        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
         }
 
-        if (codec_ctx) { 
-            avcodec_free_context(&codec_ctx); 
-            codec_ctx = NULL;
+        Wrapper* obj = NULL;
+        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
+            napi_throw_error(env, NULL, "napi_unwrap");
+            return NULL;
         }
-
-        if (img_convert_ctx) {
-            sws_freeContext(img_convert_ctx);
-            img_convert_ctx = NULL;
+        
+        FrameQueue::Stats stats = obj->_queue->stats();
+        
+        napi_value result;
+        if (napi_create_object(env, &result) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_create_object");
+            return NULL;
         }
+        
+        SetNumber(env, result, "capacity", stats.capacity);
+        SetNumber(env, result, "depth", stats.depth);
+        SetNumber(env, result, "dropped", (double)stats.dropped);
+        SetNumber(env, result, "expired", (double)stats.expired);
+        return result;
     }
     
-    ~AVContext(){ close(); }
-    
-public:
-    AVFormatContext *format_ctx = NULL;
-    int video_index = -1;
-    AVCodecContext *codec_ctx = NULL;
-    AVCodec *codec = NULL;
-    AVFrame  *frame = NULL;
-    AVPacket *packet = NULL;
-    AVFrame  *out_frame = NULL;
-    uint8_t *out_buffer = NULL;
-    int out_buffer_size = 0;
-    SwsContext *img_convert_ctx = NULL;
+private:
+    napi_env _env = NULL;
+    napi_ref _wrapper = NULL;
+    AVContext *_ctx = NULL;
+    Worker *_worker = NULL;
+    FrameQueue *_queue = NULL;
+    napi_threadsafe_function _tsfn = NULL;
+    int _pending = 0;
+    napi_ref _ring = NULL;
+    std::vector<napi_ref> _rings;
+    // The options of the last open(), for checks on the main thread.
+    StreamOptions _options;
 };
 
-class Wrapper {
+// A stream owned by a StreamManager. Its work is a chain of short steps
+// on the shared pool, each reading at most one packet and re-posting
+// itself, so a busy stream cannot starve the others. A stalled one can:
+// its read blocks a pool thread for up to the socket `timeout`, and an
+// open or reconnect for up to `timeout` plus probing, which is why
+// managed streams default to a short one.
+struct ManagedStream {
+    uint32_t id = 0;
+    std::string url;
+    AVContext ctx;
+    std::atomic<bool> removed{false};
+    std::atomic<bool> waiting{false};
+    std::atomic<int> in_flight{0};
+};
+
+// A frame, error or end of stream on its way to the manager's callback.
+struct Delivery {
+    std::shared_ptr<ManagedStream> stream;
+    int status = 0;
+    FrameOutput output;
+};
+
+class StreamManager {
 public:
-    Wrapper(){}
+    // Frames a stream may have queued for the callback before it pauses.
+    static const int MAX_IN_FLIGHT = 2;
     
-    ~Wrapper(){
-        if (_ctx) { delete _ctx; }
+    StreamManager(){}
+    
+    ~StreamManager(){
+        shutdown();
+        if (_tsfn) { napi_release_threadsafe_function(_tsfn, napi_tsfn_abort); }
         
         napi_delete_reference(_env, _wrapper);
     }
@@ -153,14 +4178,16 @@ public:
     static napi_value Init(napi_env env, napi_value exports){
         
         napi_property_descriptor properties[] = {
-          { "open", 0, open, 0, 0, 0, napi_default, 0 },
-          { "read", 0, read, 0, 0, 0, napi_default, 0 },
+          { "add", 0, add, 0, 0, 0, napi_default, 0 },
+          { "remove", 0, remove, 0, 0, 0, napi_default, 0 },
+          { "getStats", 0, getStats, 0, 0, 0, napi_default, 0 },
+          { "getTrace", 0, getTrace, 0, 0, 0, napi_default, 0 },
           { "close", 0, close, 0, 0, 0, napi_default, 0 }
         };
         
         napi_value cons;
         if (napi_define_class(env,
-                        "Rtsp",
+                        "StreamManager",
                         NAPI_AUTO_LENGTH,
                         New, 
                         NULL, 
@@ -171,207 +4198,390 @@ public:
             return NULL;
         }
         
-       napi_ref* cons_ref = new napi_ref;
-       if (napi_create_reference(env, cons, 1, cons_ref) != napi_ok){
-            napi_throw_error(env, NULL, "napi_create_reference");
-            return NULL;
-       }
-       
-       if (napi_set_instance_data(env, 
-                             cons_ref,
-                             [](napi_env env, void* data, void* hint) {
-                                napi_ref* cons_ref = static_cast<napi_ref*>(data);
-                                napi_delete_reference(env, *cons_ref);
-                                delete cons_ref;
-                             },
-                             NULL) != napi_ok) {
-            napi_throw_error(env, NULL, "napi_set_instance_data");
+        if (napi_set_named_property(env, exports, "StreamManager", cons) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_set_named_property");
             return NULL;
         }
-                             
-       if (napi_set_named_property(env, exports, "Rtsp", cons) != napi_ok) {
-           napi_throw_error(env, NULL, "napi_set_named_property");
-           return NULL;
-       }
-       
-       return exports;
+        
+        return exports;
     }
     
+    // new StreamManager(callback, { threads }); callback(err, id, frame).
     static napi_value New(napi_env env, napi_callback_info info) {
-
-        napi_value target;
-        if (napi_get_new_target(env, info, &target) != napi_ok){
-           napi_throw_error(env, NULL, "napi_get_new_target");
-           return NULL;
+        size_t argc = 2;
+        napi_value args[2];
+        napi_value _this;
+        if (napi_get_cb_info(env, info, &argc, args, &_this, NULL) != napi_ok){
+            napi_throw_error(env, NULL, "napi_get_cb_info");
+            return NULL;
         }
         
-        if (target != NULL) {
-            size_t argc = 1;
-            napi_value args[1];
-            napi_value _this;
-            if (napi_get_cb_info(env, info, &argc, args, &_this, NULL) != napi_ok){
-                napi_throw_error(env, NULL, "napi_get_cb_info");
+        napi_valuetype type;
+        if (argc < 1 || napi_typeof(env, args[0], &type) != napi_ok || type != napi_function) {
+            napi_throw_type_error(env, NULL, "callback");
+            return NULL;
+        }
+        
+        int threads = (int)std::thread::hardware_concurrency();
+        if (argc > 1) {
+            if (napi_typeof(env, args[1], &type) != napi_ok ||
+                (type == napi_object && !GetInt(env, args[1], "threads", &threads))) {
+                napi_throw_type_error(env, NULL, "options");
                 return NULL;
             }
-            
-            Wrapper* obj = new Wrapper();
-            obj->_env = env;
-            obj->_ctx = new AVContext();
-            
-            if (napi_wrap(env,
-                      _this,
-                      reinterpret_cast<void*>(obj),
-                      Wrapper::Destructor,
-                      NULL, 
-                      &obj->_wrapper) != napi_ok) {
-                napi_throw_error(env, NULL, "napi_wrap");
-                return NULL;
+        }
+        if (threads < 1) {
+            threads = 1;
+        }
+        
+        StreamManager* obj = new StreamManager();
+        obj->_env = env;
+        
+        napi_value name;
+        if (napi_create_string_utf8(env, "StreamManager", NAPI_AUTO_LENGTH, &name) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_create_string_utf8");
+            return NULL;
+        }
+        
+        if (napi_create_threadsafe_function(env,
+                                            args[0],
+                                            NULL,
+                                            name,
+                                            0,
+                                            1,
+                                            NULL,
+                                            NULL,
+                                            obj,
+                                            Deliver,
+                                            &obj->_tsfn) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_create_threadsafe_function");
+            return NULL;
+        }
+        
+        // Only keep the event loop alive while streams are attached.
+        napi_unref_threadsafe_function(env, obj->_tsfn);
+        
+        obj->_pool = new ThreadPool(threads);
+        
+        if (napi_wrap(env,
+                  _this,
+                  reinterpret_cast<void*>(obj),
+                  StreamManager::Destructor,
+                  NULL, 
+                  &obj->_wrapper) != napi_ok) {
+            napi_throw_error(env, NULL, "napi_wrap");
+            return NULL;
+        }
+        
+        return _this;
+    }
+    
+    static void Destructor(napi_env env, void* data, void* hint){
+        delete reinterpret_cast<StreamManager*>(data);
+    }
+    
+    // Aborts every stream and waits for the pool to wind down.
+    void shutdown() {
+        for (std::map<uint32_t, std::shared_ptr<ManagedStream> >::iterator it = _streams.begin(); it != _streams.end(); ++it) {
+            it->second->removed = true;
+            it->second->ctx.abort();
+        }
+        _streams.clear();
+        
+        if (_pool) {
+            delete _pool;
+            _pool = NULL;
+        }
+    }
+    
+    // Opens the stream on the pool, then keeps stepping it.
+    void start(std::shared_ptr<ManagedStream> stream) {
+        _pool->post([this, stream]() {
+            if (stream->removed) {
+                return;
             }
-                      
-            return _this;
-        }else {
             
-            size_t argc = 1;
-            napi_value args[1];
-            if (napi_get_cb_info(env, info, &argc, args, NULL, NULL) != napi_ok ){
-                napi_throw_error(env, NULL, "napi_get_cb_info");
-                return NULL;
+            if (stream->ctx.open(stream->url.c_str()) < 0) {
+                Delivery* delivery = new Delivery();
+                delivery->stream = stream;
+                delivery->status = -5;
+                stream->in_flight++;
+                napi_call_threadsafe_function(_tsfn, delivery, napi_tsfn_blocking);
+                return;
             }
-
-            napi_value argv[] = { args[0] };
-
-            napi_value instance;
-            if (napi_new_instance(env, 
-                              Constructor(env), 
-                              sizeof(argv) / sizeof(argv[0]), 
-                              argv, 
-                              &instance) != napi_ok) {
-                napi_throw_error(env, NULL, "napi_new_instance");
-                return NULL;
-            }
-           
-            return instance;
-        }
+            
+            step(stream);
+        });
     }
     
-    static napi_value Constructor(napi_env env){
-        void* data = NULL;
-        if (napi_get_instance_data(env, &data) != napi_ok) {
-            napi_throw_error(env, NULL, "napi_get_instance_data");
-            return NULL;
+    // Reads one packet of the stream; runs on a pool thread.
+    void step(std::shared_ptr<ManagedStream> stream) {
+        if (stream->removed) {
+            stream->ctx.close();
+            return;
         }
-
-        napi_ref* cons_ref = static_cast<napi_ref*>(data);
         
-        napi_value cons;
-        if (napi_get_reference_value(env, *cons_ref, &cons) != napi_ok){
-            napi_throw_error(env, NULL, "napi_get_reference_value");
-            return NULL;
+        // Pause until the callback catches up; see Deliver().
+        if (stream->in_flight >= MAX_IN_FLIGHT) {
+            stream->waiting = true;
+            if (stream->in_flight >= MAX_IN_FLIGHT || !stream->waiting.exchange(false)) {
+                return;
+            }
+        }
+        
+        int ret = stream->ctx.read();
+        switch (ret) {
+            case -1:
+                _pool->post([this, stream]() { step(stream); });
+                return;
+            
+            case -4:
+                _pool->post_after([this, stream]() { step(stream); }, 5);
+                return;
+            
+            default:
+                break;
+        }
+        
+        Delivery* delivery = new Delivery();
+        delivery->stream = stream;
+        delivery->status = ret == 0 ? Produce(&stream->ctx, &delivery->output) : ret;
+        
+        stream->in_flight++;
+        napi_call_threadsafe_function(_tsfn, delivery, napi_tsfn_blocking);
+        
+        if (ret == 0) {
+            _pool->post([this, stream]() { step(stream); });
         }
-        return cons;
     }
     
-    static void Destructor(napi_env env, void* data, void* hint){
-        reinterpret_cast<Wrapper*>(data)->~Wrapper();
+    // Calls the JS callback on the main thread.
+    static void Deliver(napi_env env, napi_value js_cb, void* context, void* data) {
+        Delivery* delivery = static_cast<Delivery*>(data);
+        if (env == NULL) {
+            delete delivery;
+            return;
+        }
+        
+        StreamManager* obj = static_cast<StreamManager*>(context);
+        std::shared_ptr<ManagedStream> stream = delivery->stream;
+        
+        if (!stream->removed) {
+            napi_value argv[3];
+            napi_get_null(env, &argv[0]);
+            napi_create_uint32(env, stream->id, &argv[1]);
+            napi_get_null(env, &argv[2]);
+            
+            switch (delivery->status) {
+                case 0: {
+                    argv[2] = DeliverFrame(env, &stream->ctx, &delivery->output);
+                    if (argv[2] == NULL) {
+                        argv[0] = CreateError(env, "napi_create_external_buffer");
+                        napi_get_null(env, &argv[2]);
+                    }
+                    break;
+                }
+                
+                case -3:
+                    break;
+                
+                case -5:
+                    argv[0] = CreateError(env, "open");
+                    break;
+                
+                default:
+                    argv[0] = CreateError(env, "read");
+                    break;
+            }
+            
+            napi_value global;
+            napi_get_global(env, &global);
+            napi_call_function(env, global, js_cb, 3, argv, NULL);
+        }
+        
+        // A stream that ended or failed is done; detach it.
+        if (delivery->status != 0 && obj->_streams.erase(stream->id) && obj->_streams.empty()) {
+            napi_unref_threadsafe_function(env, obj->_tsfn);
+        }
+        
+        if (--stream->in_flight < MAX_IN_FLIGHT && stream->waiting.exchange(false) && obj->_pool) {
+            obj->_pool->post([obj, stream]() { obj->step(stream); });
+        }
+        
+        delete delivery;
     }
     
-    static napi_value open(napi_env env, napi_callback_info info) {
+    static StreamManager* Unwrap(napi_env env, napi_callback_info info, size_t* argc, napi_value* args) {
         napi_value _this;
-        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
+        if (napi_get_cb_info(env, info, argc, args, &_this, NULL) != napi_ok) {
             napi_throw_error(env, NULL, "napi_get_cb_info");
             return NULL;
         }
 
-        Wrapper* obj = NULL;
+        StreamManager* obj = NULL;
         if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
             napi_throw_error(env, NULL, "napi_unwrap");
             return NULL;
         }
-        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
+        return obj;
+    }
+    
+    // add(url, options) -> id; frames arrive through the callback.
+    static napi_value add(napi_env env, napi_callback_info info) {
+        size_t argc = 2;
+        napi_value args[2];
+        StreamManager* obj = Unwrap(env, info, &argc, args);
+        if (obj == NULL) {
+            return NULL;
+        }
         
-        size_t argc = 1;
-        napi_value args[1];
-        if (napi_get_cb_info(env, info, &argc, args, NULL, NULL) != napi_ok){
-            napi_throw_error(env, NULL, "napi_get_cb_info");
+        if (obj->_pool == NULL) {
+            napi_throw_error(env, NULL, "closed");
             return NULL;
         }
         
-        char url[128] = {0};
         size_t len = 0;
-        if (napi_get_value_string_utf8(env, args[0], url, sizeof(url), &len) != napi_ok){
+        if (napi_get_value_string_utf8(env, args[0], NULL, 0, &len) != napi_ok){
             napi_throw_error(env, NULL, "napi_get_value_string_utf8");
             return NULL;
         }
-
-        if (ctx->open(url) < 0) {
-            napi_throw_error(env, NULL, "open");
+        
+        std::shared_ptr<ManagedStream> stream = std::make_shared<ManagedStream>();
+        stream->url.resize(len);
+        if (napi_get_value_string_utf8(env, args[0], &stream->url[0], len + 1, &len) != napi_ok){
+            napi_throw_error(env, NULL, "napi_get_value_string_utf8");
             return NULL;
         }
-
-        return NULL;
+        
+        // The pool parallelises across streams, so decoders default to
+        // one thread each instead of one per core.
+        // A silent camera holds a pool thread until the socket timeout, and
+        // an open until its deadline; keep that short so a few dead
+        // cameras cannot stall the rest. Reconnect's back-off waits
+        // without a thread.
+        StreamOptions options;
+        options.threads = 1;
+        options.timeout = 2000;
+        if (argc > 1 && !GetOptions(env, args[1], &options)) {
+            napi_throw_type_error(env, NULL, "options");
+            return NULL;
+        }
+        stream->ctx.options = options;
+        stream->ctx.trace.reset(options.trace);
+        
+        stream->id = ++obj->_next_id;
+        if (obj->_streams.empty()) {
+            napi_ref_threadsafe_function(env, obj->_tsfn);
+        }
+        obj->_streams[stream->id] = stream;
+        obj->start(stream);
+        
+        napi_value result;
+        napi_create_uint32(env, stream->id, &result);
+        return result;
     }
     
-    static napi_value read(napi_env env, napi_callback_info info) {
-       napi_value _this;
-        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
-            napi_throw_error(env, NULL, "napi_get_cb_info");
+    static napi_value remove(napi_env env, napi_callback_info info) {
+        size_t argc = 1;
+        napi_value args[1];
+        StreamManager* obj = Unwrap(env, info, &argc, args);
+        if (obj == NULL) {
             return NULL;
         }
-
-        Wrapper* obj = NULL;
-        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
-            napi_throw_error(env, NULL, "napi_unwrap");
+        
+        uint32_t id = 0;
+        if (napi_get_value_uint32(env, args[0], &id) != napi_ok) {
+            napi_throw_type_error(env, NULL, "napi_get_value_uint32");
             return NULL;
         }
-        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
-
-        switch (ctx->read()) {
-            case -2: 
-                napi_throw_error(env, NULL, "read");
-                return NULL;
-               
-            case 0: {
-                void *result_data = NULL;
-                napi_value result;
-                if (napi_create_buffer_copy(env, 
-                                            ctx->out_buffer_size, 
-                                            ctx->out_buffer,
-                                            &result_data,
-                                            &result) != napi_ok){
-                    return NULL;
-                }
-                return result;
-            }
-
-            default: { return NULL; }
+        
+        std::map<uint32_t, std::shared_ptr<ManagedStream> >::iterator it = obj->_streams.find(id);
+        napi_value result;
+        napi_get_boolean(env, it != obj->_streams.end(), &result);
+        if (it == obj->_streams.end()) {
+            return result;
+        }
+        
+        std::shared_ptr<ManagedStream> stream = it->second;
+        obj->_streams.erase(it);
+        if (obj->_streams.empty()) {
+            napi_unref_threadsafe_function(env, obj->_tsfn);
+        }
+        
+        // A paused stream has no step queued; give it one to close itself.
+        stream->removed = true;
+        stream->ctx.abort();
+        if (stream->waiting.exchange(false) && obj->_pool) {
+            obj->_pool->post([obj, stream]() { obj->step(stream); });
         }
+        return result;
     }
     
-    static napi_value close(napi_env env, napi_callback_info info) {
-        napi_value _this;
-        if (napi_get_cb_info(env, info, NULL, NULL, &_this, NULL) != napi_ok) {
-            napi_throw_error(env, NULL, "napi_get_cb_info");
+    // Looks up the stream named by the first argument; NULL when unknown.
+    static ManagedStream* Find(napi_env env, napi_callback_info info) {
+        size_t argc = 1;
+        napi_value args[1];
+        StreamManager* obj = Unwrap(env, info, &argc, args);
+        if (obj == NULL) {
             return NULL;
         }
-
-        Wrapper* obj = NULL;
-        if (napi_unwrap(env, _this, reinterpret_cast<void**>(&obj)) != napi_ok){
-            napi_throw_error(env, NULL, "napi_unwrap");
+        
+        uint32_t id = 0;
+        if (napi_get_value_uint32(env, args[0], &id) != napi_ok) {
+            napi_throw_type_error(env, NULL, "napi_get_value_uint32");
             return NULL;
         }
-        AVContext *ctx = static_cast<AVContext*>(obj->_ctx);
-        ctx->close();
+        
+        std::map<uint32_t, std::shared_ptr<ManagedStream> >::iterator it = obj->_streams.find(id);
+        return it == obj->_streams.end() ? NULL : it->second.get();
+    }
+    
+    static napi_value getStats(napi_env env, napi_callback_info info) {
+        ManagedStream* stream = Find(env, info);
+        if (stream == NULL) {
+            return NULL;
+        }
+        return StatsValue(env, stream->ctx.stats, stream->in_flight, 0);
+    }
+    
+    static napi_value getTrace(napi_env env, napi_callback_info info) {
+        ManagedStream* stream = Find(env, info);
+        if (stream == NULL) {
+            return NULL;
+        }
+        return TraceValue(env, stream->ctx.trace);
+    }
+    
+    static napi_value close(napi_env env, napi_callback_info info) {
+        StreamManager* obj = Unwrap(env, info, NULL, NULL);
+        if (obj == NULL) {
+            return NULL;
+        }
+        
+        if (!obj->_streams.empty()) {
+            napi_unref_threadsafe_function(env, obj->_tsfn);
+        }
+        obj->shutdown();
         return NULL;
     }
     
 private:
     napi_env _env = NULL;
     napi_ref _wrapper = NULL;
-    AVContext *_ctx = NULL;
+    napi_threadsafe_function _tsfn = NULL;
+    ThreadPool* _pool = NULL;
+    std::map<uint32_t, std::shared_ptr<ManagedStream> > _streams;
+    uint32_t _next_id = 0;
 };
 
 napi_value Init (napi_env env, napi_value exports) {
-    return Wrapper::Init(env, exports);
+    static std::once_flag network;
+    std::call_once(network, []() { avformat_network_init(); });
+    
+    if (Wrapper::Init(env, exports) == NULL) {
+        return NULL;
+    }
+    return StreamManager::Init(env, exports);
 }
 
-NAPI_MODULE(NODE_GYP_MODULE_NAME, Init);
\ No newline at end of file
+NAPI_MODULE(NODE_GYP_MODULE_NAME, Init);